@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cw.h"
+#include "encoder.h"
+#include "lesson.h"
+#include "pcm.h"
+#include "synth.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#define for if(0);else for
+#endif
+
+// Times the encoder and the pieces around it. Every case is run a few
+// times untimed first, so that caches and the page cache are warm, then
+// Runs times; the median rate is reported along with the 10th and 90th
+// percentiles, which show how steady it was.
+
+int Runs = 15;
+int Warmup = 3;
+const char *Filter = NULL;
+
+const char *TempFile = "bench.tmp";
+
+struct Rates {
+    double p10;
+    double p50;
+    double p90;
+};
+
+static int compare(const void *a, const void *b)
+{
+    double x = *reinterpret_cast<const double *>(a);
+    double y = *reinterpret_cast<const double *>(b);
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// A case to time: run() does one pass and returns how many of the thing
+// being counted it got through.
+class Case {
+public:
+    virtual ~Case() {}
+    virtual double run() = 0;
+};
+
+static Rates measure(Case &c)
+{
+    for (int i = 0; i < Warmup; i++) {
+        c.run();
+    }
+    double *rates = new double[Runs];
+    for (int i = 0; i < Runs; i++) {
+        double start = monotonic();
+        double n = c.run();
+        double t = monotonic() - start;
+        rates[i] = t > 0 ? n/t : 0;
+    }
+    qsort(rates, Runs, sizeof(double), compare);
+    Rates r;
+    r.p10 = rates[static_cast<int>(0.1*(Runs-1) + 0.5)];
+    r.p50 = rates[static_cast<int>(0.5*(Runs-1) + 0.5)];
+    r.p90 = rates[static_cast<int>(0.9*(Runs-1) + 0.5)];
+    delete[] rates;
+    return r;
+}
+
+// Prints the rates of a case, and optionally the median again in a
+// second unit, per of which make up one of the first.
+static void report(const char *name, Case &c, const char *unit, double per = 0, const char *unit2 = NULL)
+{
+    if (Filter != NULL && strstr(name, Filter) == NULL) {
+        return;
+    }
+    Rates r = measure(c);
+    printf("%-28s %10.3g %10.3g %10.3g  %s", name, r.p50, r.p10, r.p90, unit);
+    if (unit2 != NULL) {
+        printf("  %10.3g %s", r.p50*per, unit2);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+enum Sink {SINK_NULL, SINK_WAV, SINK_RAW, SINK_FLAC};
+static const char *SinkNames[] = {"null", "wav", "raw", "flac"};
+
+static PcmOutput *open_sink(Sink sink, int sample_rate, SampleFormat format)
+{
+    switch (sink) {
+    case SINK_WAV:
+        return new PcmOutputBuffered(new PcmOutputWav(TempFile, sample_rate, format, false), 65536);
+    case SINK_RAW:
+        return new PcmOutputStream(TempFile, sample_rate, format, false);
+    case SINK_FLAC:
+        return new PcmOutputFlac(TempFile, sample_rate, format);
+    default:
+        return new PcmOutputNull(sample_rate, format);
+    }
+}
+
+// Sends the text the way morse does, followed by a word gap, to a new
+// output of the given kind, and counts characters.
+class Send: public Case {
+public:
+    Send(Synth *synth, Sink sink, const char *text) : synth(synth), sink(sink), text(text) {}
+    virtual double run()
+    {
+        PcmOutput *out = open_sink(sink, synth->getSampleRate(), synth->getSampleFormat());
+        int len = static_cast<int>(strlen(text));
+        long long carry = 0;
+        synth->send(out, text, len, &carry);
+        synth->send(out, " ", 1, &carry);
+        out->flush();
+        delete out;
+        return len;
+    }
+private:
+    Synth *synth;
+    Sink sink;
+    const char *text;
+};
+
+// Setting up a Synth renders every character once.
+class Setup: public Case {
+public:
+    Setup(int wpm_chars, int wpm_total, int freq) : wpm_chars(wpm_chars), wpm_total(wpm_total), freq(freq) {}
+    virtual double run()
+    {
+        Synth synth(22050, FORMAT_S16, wpm_chars, wpm_total, freq, 16000, "linear");
+        return 1;
+    }
+private:
+    int wpm_chars;
+    int wpm_total;
+    int freq;
+};
+
+// The Koch lesson generator, in characters of groups made.
+class Groups: public Case {
+public:
+    virtual double run()
+    {
+        char words[20000];
+        srand(1);
+        int n = 0;
+        for (int i = 0; i < 20; i++) {
+            make_groups(words, sizeof(words), LEVEL_MAX, 1000);
+            n += static_cast<int>(strlen(words));
+        }
+        return n;
+    }
+};
+
+// Decoding dots and dashes back to text, which is what unmorse.py does
+// and unmorse -t does natively: codes separated by spaces, words by " / ".
+class Decode: public Case {
+public:
+    Decode(const char *text) : checksum(0)
+    {
+        int size = static_cast<int>(strlen(text))*10 + 1;
+        codes = new char[size];
+        char *p = codes;
+        for (const char *t = text; *t != 0; t++) {
+            if (*t == ' ') {
+                strcpy(p, "/ ");
+                p += 2;
+                continue;
+            }
+            const char *code = getcode(*t);
+            if (code != NULL) {
+                p += sprintf(p, "%s ", code);
+            }
+        }
+        *p = 0;
+    }
+    ~Decode() { delete[] codes; }
+    virtual double run()
+    {
+        int n = 0;
+        for (int i = 0; i < 100; i++) {
+            char code[8];
+            int len = 0;
+            for (const char *p = codes; *p != 0; p++) {
+                if (*p == '.' || *p == '-') {
+                    if (len < 7) {
+                        code[len++] = *p;
+                    }
+                } else if (len > 0) {
+                    code[len] = 0;
+                    checksum += decode(code);
+                    n++;
+                    len = 0;
+                }
+            }
+        }
+        return n;
+    }
+    int checksum;
+private:
+    char *codes;
+};
+
+int main(int argc, char *argv[])
+{
+    int a = 1;
+    while (a < argc && argv[a][0] == '-') {
+        switch (argv[a][1]) {
+        case 'n':
+            if (argv[a][2]) {
+                Runs = atoi(argv[a]+2);
+            } else {
+                a++;
+                Runs = atoi(argv[a]);
+            }
+            break;
+        case 'w':
+            if (argv[a][2]) {
+                Warmup = atoi(argv[a]+2);
+            } else {
+                a++;
+                Warmup = atoi(argv[a]);
+            }
+            break;
+        default:
+            fprintf(stderr, "%s: invalid option %s\n", argv[0], argv[a]);
+            fprintf(stderr, "usage: %s [-n runs] [-w warmup] [filter]\n", argv[0]);
+            exit(1);
+        }
+        a++;
+    }
+    if (a < argc) {
+        Filter = argv[a];
+    }
+    if (Runs < 1) {
+        Runs = 1;
+    }
+    Encoder::init();
+
+    // the same text every time: 100 groups of the full Koch alphabet
+    static char text[4000];
+    srand(1);
+    make_groups(text, sizeof(text), LEVEL_MAX, 100);
+
+    printf("%-28s %10s %10s %10s\n", "case", "median", "p10", "p90");
+    static const int Speeds[][2] = {{18, 5}, {20, 20}, {40, 40}};
+    static const int Freqs[] = {500, 750, 1000};
+    char name[100];
+    for (int s = 0; s < 3; s++) {
+        for (int f = 0; f < 3; f++) {
+            sprintf(name, "setup %d/%d %dHz", Speeds[s][0], Speeds[s][1], Freqs[f]);
+            Setup setup(Speeds[s][0], Speeds[s][1], Freqs[f]);
+            report(name, setup, "synths/s");
+        }
+    }
+    for (int s = 0; s < 3; s++) {
+        for (int f = 0; f < 3; f++) {
+            Synth synth(22050, FORMAT_S16, Speeds[s][0], Speeds[s][1], Freqs[f], 16000, "linear");
+            int len = static_cast<int>(strlen(text));
+            double per = double(synth.length(text, len) + synth.length(" ", 1))/len;
+            for (int k = SINK_NULL; k <= SINK_FLAC; k++) {
+                sprintf(name, "send %d/%d %dHz %s", Speeds[s][0], Speeds[s][1], Freqs[f], SinkNames[k]);
+                Send send(&synth, static_cast<Sink>(k), text);
+                report(name, send, "chars/s", per, "samples/s");
+            }
+        }
+    }
+    Groups groups;
+    report("koch groups", groups, "chars/s");
+    Decode decoder(text);
+    report("decode text", decoder, "chars/s");
+    remove(TempFile);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Renders the same text with and without -j, and with the input mapped,
+# and checks that all three come out the same. The text has UTF-8 and
+# prosigns, which must not be cut in two where the input is split up.
+set -e
+dir=${TMPDIR:-/tmp}/check-render.$$
+mkdir -p $dir
+trap 'rm -rf $dir' 0
+i=0
+while [ $i -lt 300 ]; do
+    printf 'abc <SK> de <BT> fgh \320\277\321\200\320\270\320\262\320\265\321\202 \303\204\303\226 ' >> $dir/in.txt
+    i=`expr $i + 1`
+done
+echo >> $dir/in.txt
+printf '\320\220 .-\n\320\237 .--.\n\320\240 .-.\n\320\222 .--\n\320\225 .\n\320\242 -\n\320\230 ..\n' > $dir/table.txt
+for speed in "-c 20 -w 20" "-c 18 -w 7"; do
+    ./morse $speed -L $dir/table.txt -o $dir/one.wav < $dir/in.txt
+    ./morse $speed -L $dir/table.txt -j 4 -o $dir/many.wav < $dir/in.txt
+    ./morse $speed -L $dir/table.txt -i $dir/in.txt -o $dir/mapped.wav
+    cmp $dir/one.wav $dir/many.wav
+    cmp $dir/one.wav $dir/mapped.wav
+done
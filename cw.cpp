@@ -0,0 +1,586 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cw.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#define for if(0);else for
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TOKENIZE_SSE2
+#endif
+
+cw CW[] = {
+    {'A', ".-"},
+    {'B', "-..."},
+    {'C', "-.-."},
+    {'D', "-.."},
+    {'E', "."},
+    {'F', "..-."},
+    {'G', "--."},
+    {'H', "...."},
+    {'I', ".."},
+    {'J', ".---"},
+    {'K', "-.-"},
+    {'L', ".-.."},
+    {'M', "--"},
+    {'N', "-."},
+    {'O', "---"},
+    {'P', ".--."},
+    {'Q', "--.-"},
+    {'R', ".-."},
+    {'S', "..."},
+    {'T', "-"},
+    {'U', "..-"},
+    {'V', "...-"},
+    {'W', ".--"},
+    {'X', "-..-"},
+    {'Y', "-.--"},
+    {'Z', "--.."},
+    {'1', ".----"},
+    {'2', "..---"},
+    {'3', "...--"},
+    {'4', "....-"},
+    {'5', "....."},
+    {'6', "-...."},
+    {'7', "--..."},
+    {'8', "---.."},
+    {'9', "----."},
+    {'0', "-----"},
+    {',', "--..--"},
+    {'.', ".-.-.-"},
+    {'/', "-..-."},
+    {'?', "..--.."},
+
+    {';', "-.-.-"},
+    {':', "---..."},
+    {'-', "-....-"},
+    {'\'',".----."},
+    {'(', "-.--."},
+    {')', "-.--.-"},
+    {'_', "..--.-"},
+    {'', ".--.-"},
+    {'', ".-.-"},
+    {'', "..-.."},
+    {'', "--.--"},
+    {'', "---."},
+    {'', "..--"},
+};
+
+const int NCW = sizeof(CW)/sizeof(CW[0]);
+
+// Prosigns are sent as one character, and written as their name in
+// angle brackets.
+static const struct {
+    const char *name;
+    const char *code;
+} Prosigns[] = {
+    {"AR", ".-.-."},
+    {"AS", ".-..."},
+    {"BK", "-...-.-"},
+    {"BT", "-...-"},
+    {"CL", "-.-..-.."},
+    {"CT", "-.-.-"},
+    {"HH", "........"},
+    {"KN", "-.--."},
+    {"SK", "...-.-"},
+    {"SN", "...-."},
+    {"SOS", "...---..."},
+    {"VE", "...-."},
+};
+
+const char **Table;
+int TableSize;
+static int TableCapacity;
+
+Code Codes[256];
+char Tree[256];
+const char *TreeProsign[256];
+
+// What each character below 256 was given itself, before lower case is
+// folded onto upper case to make Codes[].
+static int Direct[256];
+
+// Characters from 256 up are found through a hash table with open
+// addressing, at most half full; 0 marks an empty slot.
+struct Slot {
+    unsigned long c;
+    int index;
+};
+static Slot *Slots;
+static unsigned long SlotMask;
+static int SlotsUsed;
+
+static int Unknown = UNKNOWN_DROP;
+
+struct Name {
+    char name[MAX_PROSIGN+1];
+    int index;
+};
+static Name *Names;
+static int NamesUsed;
+static int NamesCapacity;
+
+static int add_code(const char *code)
+{
+    if (TableSize == TableCapacity) {
+        TableCapacity = TableCapacity > 0 ? 2*TableCapacity : 128;
+        const char **t = new const char *[TableCapacity];
+        for (int i = 0; i < TableSize; i++) {
+            t[i] = Table[i];
+        }
+        delete[] Table;
+        Table = t;
+    }
+    Table[TableSize] = code;
+    return TableSize++;
+}
+
+static Slot *find_slot(unsigned long c)
+{
+    unsigned long i = (c*2654435761UL) & SlotMask;
+    while (Slots[i].c != 0 && Slots[i].c != c) {
+        i = (i+1) & SlotMask;
+    }
+    return &Slots[i];
+}
+
+static void define(unsigned long c, int index)
+{
+    if (c < 256) {
+        Direct[c] = index;
+        return;
+    }
+    if (2*(SlotsUsed+1) > static_cast<long>(SlotMask+1)) {
+        Slot *old = Slots;
+        unsigned long size = SlotMask+1;
+        SlotMask = 2*size-1;
+        Slots = new Slot[2*size];
+        for (unsigned long i = 0; i < 2*size; i++) {
+            Slots[i].c = 0;
+        }
+        for (unsigned long i = 0; i < size; i++) {
+            if (old[i].c != 0) {
+                *find_slot(old[i].c) = old[i];
+            }
+        }
+        delete[] old;
+    }
+    Slot *s = find_slot(c);
+    if (s->c == 0) {
+        s->c = c;
+        SlotsUsed++;
+    }
+    s->index = index;
+}
+
+static void define_prosign(const char *name, int index)
+{
+    for (int i = 0; i < NamesUsed; i++) {
+        if (strcmp(Names[i].name, name) == 0) {
+            Names[i].index = index;
+            return;
+        }
+    }
+    if (NamesUsed == NamesCapacity) {
+        NamesCapacity = NamesCapacity > 0 ? 2*NamesCapacity : 32;
+        Name *n = new Name[NamesCapacity];
+        for (int i = 0; i < NamesUsed; i++) {
+            n[i] = Names[i];
+        }
+        delete[] Names;
+        Names = n;
+    }
+    strcpy(Names[NamesUsed].name, name);
+    Names[NamesUsed].index = index;
+    NamesUsed++;
+}
+
+// What to send for a character that has no code.
+static int unknown_code()
+{
+    switch (Unknown) {
+    case UNKNOWN_SUBSTITUTE:
+        return Direct[static_cast<unsigned char>('?')];
+    case UNKNOWN_REPORT:
+        return CODE_UNKNOWN;
+    default:
+        return CODE_NONE;
+    }
+}
+
+// Lower case letters, including the Latin-1 ones, that have no code of
+// their own are sent as upper case.
+static void fold_codes()
+{
+    for (int c = 0; c < 256; c++) {
+        int index = Direct[c];
+        if (index < 0 && ((c >= 'a' && c <= 'z') || (c >= 0xe0 && c <= 0xfe && c != 0xf7))) {
+            index = Direct[c-0x20];
+        }
+        Codes[c].code = index >= 0 ? Table[index] : NULL;
+        if (index >= 0) {
+            Codes[c].index = index;
+        } else if (c <= ' ' || c == 0x7f || (c >= 0x80 && c < 0xa0)) {
+            Codes[c].index = CODE_NONE;
+        } else {
+            Codes[c].index = unknown_code();
+        }
+    }
+    Codes[static_cast<unsigned char>(' ')].index = CODE_SPACE;
+}
+
+void set_unknown(int policy)
+{
+    Unknown = policy;
+    fold_codes();
+}
+
+void init_codes()
+{
+    TableSize = 0;
+    delete[] Slots;
+    SlotMask = 255;
+    Slots = new Slot[SlotMask+1];
+    for (unsigned long i = 0; i <= SlotMask; i++) {
+        Slots[i].c = 0;
+    }
+    SlotsUsed = 0;
+    NamesUsed = 0;
+    for (int i = 0; i < 256; i++) {
+        Direct[i] = -1;
+        Tree[i] = 0;
+        TreeProsign[i] = NULL;
+    }
+    for (int i = 0; i < NCW; i++) {
+        int node = 1;
+        for (const char *p = CW[i].code; *p != 0; p++) {
+            node = tree_next(node, *p == '-');
+        }
+        if (Tree[node] == 0) {
+            Tree[node] = CW[i].c;
+        }
+        int index = add_code(CW[i].code);
+        unsigned char c = CW[i].c;
+        if (Direct[c] < 0) {
+            Direct[c] = index;
+        }
+    }
+    for (size_t i = 0; i < sizeof(Prosigns)/sizeof(Prosigns[0]); i++) {
+        // a prosign sent like a character, as <KN> is like (, decodes as
+        // that character, and one too long for the tree not at all
+        int node = 1;
+        for (const char *p = Prosigns[i].code; *p != 0; p++) {
+            node = tree_next(node, *p == '-');
+        }
+        if (node != 0 && Tree[node] == 0 && TreeProsign[node] == NULL) {
+            TreeProsign[node] = Prosigns[i].name;
+        }
+        define_prosign(Prosigns[i].name, add_code(Prosigns[i].code));
+    }
+    fold_codes();
+}
+
+// Reads one character of UTF-8, or failing that a byte of Latin-1.
+static unsigned long read_char(const char *&p, const char *end)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(p);
+    unsigned long c = s[0];
+    int n = c >= 0xc2 && c <= 0xdf ? 1 : c >= 0xe0 && c <= 0xef ? 2 : c >= 0xf0 && c <= 0xf4 ? 3 : 0;
+    if (n > 0 && end - p > n) {
+        unsigned long u = c & (0x3f >> n);
+        int i = 1;
+        for (; i <= n && (s[i] & 0xc0) == 0x80; i++) {
+            u = (u << 6) | (s[i] & 0x3f);
+        }
+        static const unsigned long least[] = {0, 0x80, 0x800, 0x10000};
+        if (i > n && u >= least[n] && u <= 0x10ffff && (u < 0xd800 || u > 0xdfff)) {
+            p += n+1;
+            return u;
+        }
+    }
+    p++;
+    return c;
+}
+
+// Cyrillic, Greek and kana have no upper case in Morse: the lower case
+// letters and hiragana are sent as the upper case letters and katakana.
+static unsigned long fold(unsigned long c)
+{
+    if (c >= 0x430 && c <= 0x44f) {
+        return c - 0x20;
+    } else if (c >= 0x450 && c <= 0x45f) {
+        return c - 0x50;
+    } else if (c == 0x3c2) {
+        return 0x3a3;
+    } else if (c >= 0x3b1 && c <= 0x3c9) {
+        return c - 0x20;
+    } else if (c >= 0x3041 && c <= 0x3096) {
+        return c + 0x60;
+    }
+    return c;
+}
+
+int lookup_code(unsigned long c)
+{
+    if (c < 256) {
+        return Codes[c].index;
+    }
+    Slot *s = find_slot(c);
+    if (s->c == 0 && fold(c) != c) {
+        s = find_slot(fold(c));
+    }
+    if (s->c != 0) {
+        return s->index;
+    }
+    // line and paragraph separators and zero width characters
+    if (c == 0x2028 || c == 0x2029 || (c >= 0x200b && c <= 0x200f) || c == 0xfeff) {
+        return CODE_NONE;
+    }
+    return unknown_code();
+}
+
+static Mutex ReportLock;
+static unsigned char Reported[0x110000/8];
+
+static void report(unsigned long c)
+{
+    ReportLock.lock();
+    if ((Reported[c/8] & (1 << c%8)) == 0) {
+        Reported[c/8] |= 1 << c%8;
+        char utf8[5];
+        int n = 0;
+        if (c < 0x80) {
+            utf8[n++] = static_cast<char>(c);
+        } else if (c < 0x800) {
+            utf8[n++] = static_cast<char>(0xc0 | c >> 6);
+            utf8[n++] = static_cast<char>(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            utf8[n++] = static_cast<char>(0xe0 | c >> 12);
+            utf8[n++] = static_cast<char>(0x80 | (c >> 6 & 0x3f));
+            utf8[n++] = static_cast<char>(0x80 | (c & 0x3f));
+        } else {
+            utf8[n++] = static_cast<char>(0xf0 | c >> 18);
+            utf8[n++] = static_cast<char>(0x80 | (c >> 12 & 0x3f));
+            utf8[n++] = static_cast<char>(0x80 | (c >> 6 & 0x3f));
+            utf8[n++] = static_cast<char>(0x80 | (c & 0x3f));
+        }
+        utf8[n] = 0;
+        fprintf(stderr, "no code for %s (U+%04lX)\n", utf8, c);
+    }
+    ReportLock.unlock();
+}
+
+// Reads a character that is not plain ASCII, or a prosign, and returns
+// what to send for it.
+static int read_code(const char *&p, const char *end, unsigned long &c)
+{
+    if (*p == '<') {
+        char name[MAX_PROSIGN+1];
+        int len = 0;
+        const char *q = p+1;
+        // names are letters and digits, so most text that is not a
+        // prosign is seen not to be within a character or two
+        for (; q < end && len < MAX_PROSIGN && isalnum(static_cast<unsigned char>(*q)); q++) {
+            name[len++] = *q >= 'a' && *q <= 'z' ? *q - 'a' + 'A' : *q;
+        }
+        if (q < end && *q == '>' && len > 0) {
+            name[len] = 0;
+            for (int i = 0; i < NamesUsed; i++) {
+                if (Names[i].name[0] == name[0] && strcmp(Names[i].name, name) == 0) {
+                    p = q+1;
+                    return Names[i].index;
+                }
+            }
+        }
+        p++;
+        c = '<';
+        return Codes[c].index;
+    }
+    c = read_char(p, end);
+    return lookup_code(c);
+}
+
+#ifdef TOKENIZE_SSE2
+static inline int first_bit(int mask)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return static_cast<int>(i);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+int tokenize(const char *&p, const char *end, int *out, int max)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(p);
+    const unsigned char *e = reinterpret_cast<const unsigned char *>(end);
+    int n = 0;
+    while (s < e && n < max) {
+#ifdef TOKENIZE_SSE2
+        // the top bit marks a byte of UTF-8, and '<' may start a prosign
+        const __m128i lt = _mm_set1_epi8('<');
+        while (e - s >= 16 && max - n >= 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+            int mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, lt)));
+            int k = mask == 0 ? 16 : first_bit(mask);
+            if (Unknown == UNKNOWN_REPORT) {
+                for (int j = 0; j < k; j++) {
+                    int i = Codes[s[j]].index;
+                    if (i == CODE_UNKNOWN) {
+                        report(s[j]);
+                        i = CODE_NONE;
+                    }
+                    out[n+j] = i;
+                }
+            } else {
+                for (int j = 0; j < k; j++) {
+                    out[n+j] = Codes[s[j]].index;
+                }
+            }
+            n += k;
+            s += k;
+            if (k < 16) {
+                break;
+            }
+        }
+        if (s == e || n == max) {
+            break;
+        }
+#endif
+        int i;
+        unsigned long c = *s;
+        if (c < 0x80 && c != '<') {
+            i = Codes[c].index;
+            s++;
+        } else {
+            const char *q = reinterpret_cast<const char *>(s);
+            i = read_code(q, end, c);
+            s = reinterpret_cast<const unsigned char *>(q);
+        }
+        if (i >= CODE_SPACE) {
+            out[n] = i;
+            n += i != CODE_NONE;
+        } else {
+            report(c);
+        }
+    }
+    p = reinterpret_cast<const char *>(s);
+    return n;
+}
+
+static bool table_error(FILE *f, const char *fn, int line, const char *what)
+{
+    fprintf(stderr, "%s:%d: %s\n", fn, line, what);
+    fclose(f);
+    return false;
+}
+
+bool load_codes(const char *fn)
+{
+    FILE *f = fopen(fn, "r");
+    if (f == NULL) {
+        perror(fn);
+        return false;
+    }
+    char buf[256];
+    int line = 0;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        line++;
+        const char *end = buf + strlen(buf);
+        while (end > buf && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+        const char *p = buf;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end || *p == '#') {
+            continue;
+        }
+        // the character, U+ and its number, or a prosign in <>
+        unsigned long c = 0;
+        char name[MAX_PROSIGN+1];
+        name[0] = 0;
+        if (p[0] == 'U' && p[1] == '+' && isxdigit(static_cast<unsigned char>(p[2]))) {
+            char *e;
+            c = strtoul(p+2, &e, 16);
+            p = e;
+        } else if (*p == '<' && p+1 < end && p[1] != ' ' && p[1] != '\t') {
+            const char *q = reinterpret_cast<const char *>(memchr(p, '>', end-p));
+            if (q == NULL || q-p-1 > MAX_PROSIGN) {
+                return table_error(f, fn, line, "bad prosign");
+            }
+            int len = 0;
+            for (p++; p < q; p++) {
+                if (!isalnum(static_cast<unsigned char>(*p))) {
+                    return table_error(f, fn, line, "prosigns are named with letters and digits");
+                }
+                name[len++] = *p >= 'a' && *p <= 'z' ? *p - 'a' + 'A' : *p;
+            }
+            name[len] = 0;
+            p = q+1;
+        } else {
+            c = read_char(p, end);
+        }
+        if (name[0] == 0 && (c == 0 || c == ' ' || c > 0x10ffff)) {
+            return table_error(f, fn, line, "bad character");
+        }
+        if (p == end || (*p != ' ' && *p != '\t')) {
+            return table_error(f, fn, line, "expected a code after the character");
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        // one code, or several to be sent one after another
+        char *code = new char[end-p+1];
+        int len = 0;
+        for (; p < end; p++) {
+            if (*p == '.' || *p == '-') {
+                code[len++] = *p;
+            } else if (*p == ' ' || *p == '\t') {
+                if (code[len-1] != ' ') {
+                    code[len++] = ' ';
+                }
+            } else {
+                delete[] code;
+                return table_error(f, fn, line, "codes are made of . and -");
+            }
+        }
+        code[len] = 0;
+        int index = add_code(code);
+        if (name[0] != 0) {
+            define_prosign(name, index);
+        } else {
+            define(c, index);
+        }
+    }
+    fclose(f);
+    fold_codes();
+    return true;
+}
+
+const char *getcode(char c)
+{
+    return Codes[static_cast<unsigned char>(c)].code;
+}
+
+char decode(const char *code)
+{
+    int node = 1;
+    for (; *code != 0; code++) {
+        if (*code != '.' && *code != '-') {
+            return 0;
+        }
+        node = tree_next(node, *code == '-');
+    }
+    return Tree[node];
+}
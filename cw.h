@@ -0,0 +1,91 @@
+#ifndef CW_H
+#define CW_H
+
+// The code table shared by the encoder and the decoder.
+
+struct cw {
+    char c;
+    char code[8];
+};
+
+extern cw CW[];
+extern const int NCW;
+
+// Everything the encoder can send: CW[], then the prosigns, then the
+// entries of any tables loaded with load_codes(). Each is a string of
+// dots and dashes, or several separated by spaces, which are sent as
+// that many characters in a row.
+extern const char **Table;
+extern int TableSize;
+
+// Lookup table indexed directly by character below 256, so that finding
+// the code for one never has to search. Lower case letters (including
+// the Latin-1 ones) without a code of their own are folded onto the
+// entry of their upper case form. index is the position in Table, or
+// one of these: a space is sent as a word gap, control characters are
+// never sent, and what to do with any other character that has no code
+// is set by set_unknown().
+enum {CODE_NONE = -1, CODE_SPACE = -2, CODE_UNKNOWN = -3};
+
+struct Code {
+    const char *code;
+    int index;
+};
+
+extern Code Codes[256];
+
+enum {MAX_PROSIGN = 15};
+
+void init_codes();
+const char *getcode(char c);
+
+// Adds the codes in a table file, in UTF-8, to those that can be sent,
+// replacing any already given to the same characters. Each line is a
+// character, or U+ and its number in hex, or the name of a prosign in
+// angle brackets, then its code; lines starting with # are comments.
+// Call it after init_codes() and before making any Synth. Returns false,
+// having said why on stderr, if the file cannot be read.
+bool load_codes(const char *fn);
+
+// What becomes of characters without a code: they are left out, sent
+// as a question mark, or left out and reported on stderr, once for each
+// character. Like load_codes(), call it before making any Synth.
+enum {UNKNOWN_DROP, UNKNOWN_SUBSTITUTE, UNKNOWN_REPORT};
+void set_unknown(int policy);
+
+// Returns the index in Table for any character, or CODE_NONE. Characters
+// from 256 up are found through a hash table, with lower case Cyrillic
+// and Greek and hiragana folded as Latin is.
+int lookup_code(unsigned long c);
+
+// Turns text into the symbols to send, indexes into Table or CODE_SPACE,
+// writing at most max of them to out and moving p on past what they
+// came from; returns how many there are. Characters that are not sent
+// are mostly left out, but may also be there as CODE_NONE. Text is UTF-8, but bytes that
+// are not valid UTF-8 are taken as Latin-1, so Latin-1 text is read as
+// it always was. A prosign is written as its name in angle brackets,
+// like <SK>. Runs of plain ASCII are picked out 16 bytes at a time where
+// SSE2 is to hand, and cost one lookup a character.
+int tokenize(const char *&p, const char *end, int *out, int max);
+
+// Decoding tree built from CW[] and the prosigns. The root is node 1 and
+// each dot doubles the node number, each dash doubles it and adds one, so
+// every code of up to seven elements has its own node below 256.
+// Tree[node] is the character sent as that code, or 0; where there is
+// none, TreeProsign[node] is the name of the prosign sent as it, or NULL.
+extern char Tree[256];
+extern const char *TreeProsign[256];
+
+// Steps from a node of the decoding tree to the one for a further dot or
+// dash. Codes too long for the tree end up at node 0, which has no
+// character and is never left.
+inline int tree_next(int node, bool dash)
+{
+    return node > 0 && node < 128 ? 2*node + dash : 0;
+}
+
+// Returns the character sent as the given string of dots and dashes, or
+// 0 if there is none.
+char decode(const char *code);
+
+#endif
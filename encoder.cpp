@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cw.h"
+#include "encoder.h"
+#include "libmorse.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define for if(0);else for
+#else
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+
+static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK init_tables(PINIT_ONCE, PVOID, PVOID *)
+{
+    init_codes();
+    init_kernels();
+    return TRUE;
+}
+
+void Encoder::init()
+{
+    InitOnceExecuteOnce(&once, init_tables, NULL, NULL);
+}
+
+#else
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init_tables()
+{
+    init_codes();
+    init_kernels();
+}
+
+void Encoder::init()
+{
+    pthread_once(&once, init_tables);
+}
+
+#endif
+
+Encoder::Encoder(PcmOutput *out, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape, Stats *stats)
+ : out(out), stats(stats), carry(0)
+{
+    init();
+    double start = monotonic();
+    synth = new Synth(out->getSampleRate(), out->getSampleFormat(), wpm_chars, wpm_total, freq, amplitude, shape);
+    if (stats != NULL) {
+        stats->setup += monotonic() - start;
+    }
+}
+
+Encoder::~Encoder()
+{
+    delete out;
+    delete synth;
+}
+
+// A line of text is followed by a word gap, so that lines sent one after
+// another are spaced as words are.
+void Encoder::send(const char *text, int len)
+{
+    double start = stats != NULL ? monotonic() : 0;
+    int sent = synth->send(out, text, len, &carry);
+    synth->send(out, " ", 1, &carry);
+    if (stats != NULL) {
+        stats->send += monotonic() - start;
+        stats->chars += sent;
+    }
+}
+
+void Encoder::pause(int n)
+{
+    out->silence(n);
+    carry = 0;
+}
+
+long long Encoder::length(const char *text, int len, long long *carry)
+{
+    long long c = this->carry;
+    if (carry == NULL) {
+        carry = &c;
+    }
+    long long n = synth->length(text, len, carry);
+    return n + synth->length(" ", 1, carry);
+}
+
+// Hands samples to a function of the caller's.
+class PcmOutputCallback: public PcmOutput {
+public:
+    PcmOutputCallback(int sample_rate, SampleFormat format, morse_write_fn write, void *user)
+     : sample_rate(sample_rate), format(format), write(write), user(user) {}
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n) { write(user, buf, n); }
+private:
+    int sample_rate;
+    SampleFormat format;
+    morse_write_fn write;
+    void *user;
+};
+
+struct morse_encoder {
+    Encoder *encoder;
+};
+
+static bool valid(int sample_rate, int format, int wpm_chars, int wpm_total, int freq, const char *shape)
+{
+    return sample_rate >= 1000
+        && (format == MORSE_U8 || format == MORSE_S16 || format == MORSE_F32)
+        && wpm_chars > 0 && wpm_total > 0
+        && freq > 0 && 2*freq < sample_rate
+        && shape != NULL && (strcmp(shape, "linear") == 0 || strcmp(shape, "cosine") == 0);
+}
+
+static SampleFormat sample_format(int format)
+{
+    return format == MORSE_U8 ? FORMAT_U8 : format == MORSE_F32 ? FORMAT_F32 : FORMAT_S16;
+}
+
+static morse_encoder *make(PcmOutput *out, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape)
+{
+    if (wpm_chars < wpm_total) {
+        wpm_chars = wpm_total;
+    }
+    morse_encoder *e = new morse_encoder;
+    e->encoder = new Encoder(out, wpm_chars, wpm_total, freq, amplitude, shape);
+    return e;
+}
+
+morse_encoder *morse_encoder_new(int sample_rate, int format, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape, morse_write_fn write, void *user)
+{
+    if (!valid(sample_rate, format, wpm_chars, wpm_total, freq, shape) || write == NULL) {
+        return NULL;
+    }
+    return make(new PcmOutputCallback(sample_rate, sample_format(format), write, user), wpm_chars, wpm_total, freq, amplitude, shape);
+}
+
+morse_encoder *morse_encoder_new_file(int sample_rate, int format, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape, const char *path, const char *type)
+{
+    if (!valid(sample_rate, format, wpm_chars, wpm_total, freq, shape) || path == NULL || type == NULL) {
+        return NULL;
+    }
+    SampleFormat f = sample_format(format);
+    bool wav = strcmp(type, "wav") == 0 || strcmp(type, "rf64") == 0;
+    bool raw = strcmp(type, "raw") == 0;
+    bool flac = strcmp(type, "flac") == 0 && f != FORMAT_F32;
+    if (!wav && !raw && !flac) {
+        return NULL;
+    }
+    // Files are opened here rather than by the outputs, which would end
+    // the program if they could not be. As with morse, WAV on stdout is
+    // streamed, after a header whose sizes mean "until the end".
+    PcmOutput *out;
+    if (strcmp(path, "-") == 0) {
+        if (flac) {
+            out = new PcmOutputFlac(path, sample_rate, f);
+        } else {
+            out = new PcmOutputStream(path, sample_rate, f, wav);
+        }
+    } else if (raw) {
+        int fd = open_stream(path);
+        if (fd < 0) {
+            return NULL;
+        }
+        out = new PcmOutputStream(fd, sample_rate, f, false);
+    } else {
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+            return NULL;
+        }
+        if (flac) {
+            out = new PcmOutputFlac(file, sample_rate, f);
+        } else {
+            out = new PcmOutputBuffered(new PcmOutputWav(file, sample_rate, f, strcmp(type, "rf64") == 0), 65536);
+        }
+    }
+    return make(out, wpm_chars, wpm_total, freq, amplitude, shape);
+}
+
+int morse_load_table(const char *path)
+{
+    Encoder::init();
+    return load_codes(path) ? 0 : -1;
+}
+
+void morse_set_unknown(int policy)
+{
+    Encoder::init();
+    set_unknown(policy == MORSE_SUBSTITUTE ? UNKNOWN_SUBSTITUTE : policy == MORSE_REPORT ? UNKNOWN_REPORT : UNKNOWN_DROP);
+}
+
+void morse_encoder_send(morse_encoder *e, const char *text)
+{
+    e->encoder->send(text, static_cast<int>(strlen(text)));
+}
+
+long long morse_encoder_length(morse_encoder *e, const char *text)
+{
+    return e->encoder->length(text, static_cast<int>(strlen(text)));
+}
+
+int morse_encoder_sample_rate(morse_encoder *e)
+{
+    return e->encoder->getOutput()->getSampleRate();
+}
+
+void morse_encoder_flush(morse_encoder *e)
+{
+    e->encoder->flush();
+}
+
+void morse_encoder_free(morse_encoder *e)
+{
+    if (e != NULL) {
+        e->encoder->flush();
+        delete e->encoder;
+        delete e;
+    }
+}
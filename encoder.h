@@ -0,0 +1,39 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "pcm.h"
+#include "stats.h"
+#include "synth.h"
+
+// Sends text to an output with one speed and tone. An Encoder owns its
+// Synth and its output and shares nothing else but the read-only code
+// tables, so any number of them, with different settings, can be used
+// at once on different threads; each one by a single thread at a time.
+class Encoder {
+public:
+    Encoder(PcmOutput *out, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape, Stats *stats = NULL);
+    ~Encoder();
+    Synth *getSynth() { return synth; }
+    PcmOutput *getOutput() { return out; }
+    void send(const char *text, int len);
+    void flush() { out->flush(); }
+    // Outputs n samples of silence, after which sending starts afresh on
+    // a whole sample.
+    void pause(int n);
+    // The samples that sending text would produce, starting from the
+    // carry given, which is left as it would be after sending; if there
+    // is none, from where the encoder is now.
+    long long length(const char *text, int len, long long *carry = NULL);
+    long long getCarry() { return carry; }
+    // Builds the tables every Encoder uses. The constructor calls it, but
+    // it can be called first from any number of threads; only the first
+    // does the work and the rest wait for it.
+    static void init();
+private:
+    PcmOutput *out;
+    Synth *synth;
+    Stats *stats;
+    long long carry;
+};
+
+#endif
@@ -1,128 +1,305 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "cw.h"
+#include "encoder.h"
+#include "lesson.h"
+#include "pcm.h"
+#include "player.h"
+#include "synth.h"
+#include "thread.h"
+
 #ifndef _WIN32
-#include <signal.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #endif
 
 #ifdef _WIN32
 #include <windows.h>
-#define snprintf _snprintf
 #define sleep(x) Sleep((x)*1000)
 #define for if(0);else for
 #endif
 
-#ifdef _WIN32
-#define BIN_MORSE "morse.exe"
-#else
-#define BIN_MORSE "./morse"
-#endif
-
-const char Letters[] = "KMRSUAPTLOWI.NJEF0Y,VG5/Q9ZH38B?427C1D6X<BT><SK><AR>";
-const int WMAX = 10;
-
 int WPM_chars = 20;
 int WPM_total = 10;
 int Level = 2;
+bool Server = false;
+int Threads = 4;
+int SampleRate = 22050;
+
+// Server mode keeps any number of training sessions going at once,
+// driven by commands on stdin, one per line:
+//
+//   new ID [LEVEL [WPM_CHARS [WPM_TOTAL]]]
+//   round ID PATH      render the next round of groups to a WAV file
+//   answer ID TEXT     score what the student copied
+//   end ID
+//
+// Replies go to stdout, one line each: "ok ID", "ready ID PATH" once a
+// round has been written, "score ID PERCENT LEVEL GROUPS", or
+// "error ID MESSAGE". Rounds are rendered on a pool of worker threads,
+// so replies to different sessions may come back in any order. Every
+// session sending at the same speeds shares one Synth, whose symbols are
+// rendered only once.
+
+struct Session {
+    char id[64];
+    int level;
+    int wpm_total;
+    Synth *synth;
+    char words[1000];
+    Session *next;
+};
+
+struct CachedSynth {
+    int wpm_chars;
+    int wpm_total;
+    Synth *synth;
+    CachedSynth *next;
+};
+
+CachedSynth *Synths = NULL;
 
-double urand()
+Synth *get_synth(int wpm_chars, int wpm_total)
 {
-    return (double)rand() / RAND_MAX;
+    for (CachedSynth *c = Synths; c != NULL; c = c->next) {
+        if (c->wpm_chars == wpm_chars && c->wpm_total == wpm_total) {
+            return c->synth;
+        }
+    }
+    CachedSynth *c = new CachedSynth;
+    c->wpm_chars = wpm_chars;
+    c->wpm_total = wpm_total;
+    c->synth = new Synth(SampleRate, FORMAT_S16, wpm_chars, wpm_total, 750, 16000, "linear");
+    c->next = Synths;
+    Synths = c;
+    return c->synth;
 }
 
-class Morse {
+Mutex Output;
+
+void reply(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    Output.lock();
+    vprintf(fmt, args);
+    fflush(stdout);
+    Output.unlock();
+    va_end(args);
+}
+
+// Renders rounds to their files on a fixed set of worker threads.
+class Pool {
 public:
-    Morse(const char *text);
-    ~Morse();
-    void stop();
+    Pool(int nthreads);
+    ~Pool();
+    void add(const char *id, const char *path, const char *text, Synth *synth);
 private:
-#ifdef _WIN32
-    HANDLE process;
-#else
-    pid_t process;
-#endif
+    struct Job {
+        char id[64];
+        char *path;
+        char *text;
+        Synth *synth;
+        Job *next;
+    };
+    int nthreads;
+    Thread **threads;
+    Job *head;
+    Job *tail;
+    bool finished;
+    Mutex mutex;
+    Condition work;
+    static void worker(void *arg);
 };
 
-Morse::Morse(const char *text)
+Pool::Pool(int nthreads)
+ : nthreads(nthreads), head(NULL), tail(NULL), finished(false)
 {
-#ifdef _WIN32
-    char cmd[1000];
-    snprintf(cmd, sizeof(cmd), BIN_MORSE" -c%d -w%d %s", WPM_chars, WPM_total, text);
-    STARTUPINFO si;
-    ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
-    PROCESS_INFORMATION pi;
-    if (!CreateProcess(NULL, cmd, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
-        fprintf(stderr, "CreateProcess failed: %d\n", GetLastError());
-        return;
+    threads = new Thread *[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = new Thread(worker, this);
     }
-    CloseHandle(pi.hThread);
-    process = pi.hProcess;
-#else
-    process = fork();
-    if (process == 0) {
-        char wpm_chars[10];
-        snprintf(wpm_chars, sizeof(wpm_chars), "-w%d\n", WPM_chars);
-        char wpm_total[10];
-        snprintf(wpm_total, sizeof(wpm_total), "-w%d\n", WPM_total);
-        execl(BIN_MORSE, BIN_MORSE, wpm_chars, wpm_total, text, NULL);
-        fprintf(stderr, "execl failed: %d\n", errno);
-        exit(127);
+}
+
+// Waits for the rounds still queued to be written.
+Pool::~Pool()
+{
+    mutex.lock();
+    finished = true;
+    work.broadcast();
+    mutex.unlock();
+    for (int i = 0; i < nthreads; i++) {
+        threads[i]->join();
+        delete threads[i];
     }
-#endif
+    delete[] threads;
 }
 
-Morse::~Morse()
+void Pool::add(const char *id, const char *path, const char *text, Synth *synth)
 {
-    stop();
-#ifdef _WIN32
-    CloseHandle(process);
-#else
-    int status;
-    waitpid(process, &status, 0);
-#endif
+    Job *job = new Job;
+    strcpy(job->id, id);
+    job->path = new char[strlen(path)+1];
+    strcpy(job->path, path);
+    job->text = new char[strlen(text)+1];
+    strcpy(job->text, text);
+    job->synth = synth;
+    job->next = NULL;
+    mutex.lock();
+    if (tail != NULL) {
+        tail->next = job;
+    } else {
+        head = job;
+    }
+    tail = job;
+    work.broadcast();
+    mutex.unlock();
 }
 
-void Morse::stop()
+void Pool::worker(void *arg)
 {
-#ifdef _WIN32
-    TerminateProcess(process, 0);
-#else
-    kill(process, SIGTERM);
-#endif
+    Pool *This = reinterpret_cast<Pool *>(arg);
+    This->mutex.lock();
+    for (;;) {
+        while (This->head == NULL && !This->finished) {
+            This->work.wait(This->mutex);
+        }
+        Job *job = This->head;
+        if (job == NULL) {
+            break;
+        }
+        This->head = job->next;
+        if (This->head == NULL) {
+            This->tail = NULL;
+        }
+        This->mutex.unlock();
+        // a bad path from a client must not take the server down with it
+        FILE *f = fopen(job->path, "wb");
+        if (f != NULL) {
+            PcmOutput *out = new PcmOutputBuffered(new PcmOutputWav(f, job->synth->getSampleRate(), job->synth->getSampleFormat(), false), 65536);
+            long long carry = 0;
+            job->synth->send(out, job->text, strlen(job->text), &carry);
+            job->synth->send(out, " ", 1, &carry);
+            delete out;
+            reply("ready %s %s\n", job->id, job->path);
+        } else {
+            reply("error %s cannot write %s\n", job->id, job->path);
+        }
+        delete[] job->path;
+        delete[] job->text;
+        delete job;
+        This->mutex.lock();
+    }
+    This->mutex.unlock();
 }
 
-int match(const char *good, const char *test)
+Session *find_session(Session *sessions, const char *id)
 {
-    int n = 0;
-    int t = 0;
-    while (*good != 0 && *test != 0) {
-        if (isspace(*good)) {
-            while (*test != 0 && !isspace(*test)) {
-                test++;
+    for (Session *s = sessions; s != NULL; s = s->next) {
+        if (strcmp(s->id, id) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void serve()
+{
+    Pool pool(Threads);
+    Session *sessions = NULL;
+    int size = 1024;
+    char *line = new char[size];
+    while (fgets(line, size, stdin) != NULL) {
+        int len = strlen(line);
+        while (len == size-1 && line[len-1] != '\n') {
+            char *newline = new char[size*2];
+            memcpy(newline, line, len+1);
+            delete[] line;
+            line = newline;
+            size *= 2;
+            if (fgets(line+len, size-len, stdin) == NULL) {
+                break;
             }
-            if (isspace(*test)) {
-                test++;
+            len += strlen(line+len);
+        }
+        while (len > 0 && isspace(line[len-1])) {
+            line[--len] = 0;
+        }
+        char cmd[16], id[64];
+        int n = 0;
+        if (sscanf(line, "%15s %63s %n", cmd, id, &n) < 2) {
+            if (len > 0) {
+                reply("error - bad command: %s\n", line);
             }
-        } else {
-            if (toupper(*good) == toupper(*test)) {
-                t++;
+            continue;
+        }
+        const char *rest = line + n;
+        Session *s = find_session(sessions, id);
+        if (strcmp(cmd, "new") == 0) {
+            if (s != NULL) {
+                reply("error %s session exists\n", id);
+                continue;
+            }
+            int level = 2, wpm_chars = WPM_chars, wpm_total = WPM_total;
+            sscanf(rest, "%d %d %d", &level, &wpm_chars, &wpm_total);
+            if (wpm_total > wpm_chars) {
+                wpm_chars = wpm_total;
+            }
+            if (level < 2 || level > LEVEL_MAX || wpm_chars <= 0 || wpm_total <= 0) {
+                reply("error %s bad parameters\n", id);
+                continue;
+            }
+            s = new Session;
+            strcpy(s->id, id);
+            s->level = level;
+            s->wpm_total = wpm_total;
+            s->synth = get_synth(wpm_chars, wpm_total);
+            s->words[0] = 0;
+            s->next = sessions;
+            sessions = s;
+            reply("ok %s\n", id);
+        } else if (s == NULL) {
+            reply("error %s no such session\n", id);
+        } else if (strcmp(cmd, "round") == 0) {
+            if (*rest == 0) {
+                reply("error %s no output file\n", id);
+                continue;
+            }
+            make_groups(s->words, sizeof(s->words), s->level, s->wpm_total*5);
+            pool.add(id, rest, s->words, s->synth);
+        } else if (strcmp(cmd, "answer") == 0) {
+            if (s->words[0] == 0) {
+                reply("error %s no round sent\n", id);
+                continue;
             }
-            if (*test != 0 && !isspace(*test)) {
-                test++;
+            int score = match(s->words, rest);
+            s->level = next_level(s->level, score);
+            reply("score %s %d %d %s\n", id, score, s->level, s->words);
+            s->words[0] = 0;
+        } else if (strcmp(cmd, "end") == 0) {
+            Session **p = &sessions;
+            while (*p != s) {
+                p = &(*p)->next;
             }
-            n++;
+            *p = s->next;
+            delete s;
+            reply("ok %s\n", id);
+        } else {
+            reply("error %s bad command: %s\n", id, cmd);
         }
-        good++;
     }
-    return 100*t/n;
+    delete[] line;
+    while (sessions != NULL) {
+        Session *s = sessions;
+        sessions = s->next;
+        delete s;
+    }
 }
 
 int main(int argc, char *argv[])
@@ -138,6 +315,28 @@ int main(int argc, char *argv[])
                 WPM_chars = atoi(argv[a]);
             }
             break;
+        case 'j':
+            if (argv[a][2]) {
+                Threads = atoi(argv[a]+2);
+            } else {
+                a++;
+                Threads = atoi(argv[a]);
+            }
+            if (Threads < 1) {
+                Threads = 1;
+            }
+            break;
+        case 'r':
+            if (argv[a][2]) {
+                SampleRate = atoi(argv[a]+2);
+            } else {
+                a++;
+                SampleRate = atoi(argv[a]);
+            }
+            break;
+        case 's':
+            Server = true;
+            break;
         case 'w':
             if (argv[a][2]) {
                 WPM_total = atoi(argv[a]+2);
@@ -157,44 +356,51 @@ int main(int argc, char *argv[])
     }
     if (a < argc) {
         Level = atoi(argv[a]);
+        if (Level < 2 || Level > LEVEL_MAX) {
+            fprintf(stderr, "%s: level must be from 2 to %d\n", argv[0], LEVEL_MAX);
+            exit(1);
+        }
+    }
+    Encoder::init();
+    if (Server) {
+        srand(time(0));
+        serve();
+        return 0;
     }
+    // The device stays open and the symbols are rendered once; each round
+    // is just played on a background thread, which a ring of 10ms periods
+    // keeps from ever waiting on the device itself.
+    PcmOutput *dev = open_device(NULL, SampleRate, FORMAT_S16);
+    Player player(new PcmOutputRing(dev, dev->getSampleRate()/100, 5));
+    Synth synth(player.getSampleRate(), player.getSampleFormat(), WPM_chars, WPM_total, 750, 16000, "linear");
     srand(time(0));
     for (;;) {
-        printf("Letters: %.*s\n", Level, Letters);
+        printf("Letters: ");
+        for (int i = 0; i < Level; i++) {
+            printf("%s", Letters[i]);
+        }
+        printf("\n");
         printf("(press Enter to start)\n");
         if (getchar() == EOF) {
             break;
         }
         char words[1000];
-        words[0] = 0;
-        for (int i = 0; i < WPM_total*5; i++) {
-            int len = static_cast<int>(urand()*5+2); //5*(1/-log(urand()));
-            char word[WMAX];
-            for (int j = 0; j < len; j++) {
-                word[j] = Letters[static_cast<int>(urand()*Level)];
-            }
-            word[len] = 0;
-            strcat(words, word);
-            strcat(words, " ");
-        }
+        make_groups(words, sizeof(words), Level, WPM_total*5);
         //printf("words: %s\n", words);
         sleep(1);
-        Morse morse(words);
+        player.play(&synth, words);
         time_t start = time(0);
         char user[1000];
         if (fgets(user, sizeof(user), stdin) == NULL) {
             break;
         }
+        player.stop();
         time_t end = time(0);
         printf("%s\n", words);
         printf("%d seconds\n", end-start);
         int score = match(words, user);
         printf("%d%%\n", score);
-        if (score >= 90) {
-            Level++;
-        } else if (score < 50 && Level > 2) {
-            Level--;
-        }
+        Level = next_level(Level, score);
     }
     return 0;
 }
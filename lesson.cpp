@@ -0,0 +1,111 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lesson.h"
+
+#ifdef _WIN32
+#define for if(0);else for
+#endif
+
+const char *const Letters[] = {
+    "K", "M", "R", "S", "U", "A", "P", "T", "L", "O", "W", "I", ".", "N",
+    "J", "E", "F", "0", "Y", ",", "V", "G", "5", "/", "Q", "9", "Z", "H",
+    "3", "8", "B", "?", "4", "2", "7", "C", "1", "D", "6", "X",
+    "<BT>", "<SK>", "<AR>"
+};
+const int LEVEL_MAX = sizeof(Letters)/sizeof(Letters[0]);
+
+double urand()
+{
+    return (double)rand() / RAND_MAX;
+}
+
+// Skips one letter: a prosign in angle brackets, or a single character.
+static const char *next_letter(const char *p)
+{
+    if (*p == '<') {
+        const char *q = p+1;
+        while (*q != 0 && *q != '>' && !isspace(*q)) {
+            q++;
+        }
+        if (*q == '>') {
+            return q+1;
+        }
+    }
+    return p+1;
+}
+
+static bool same_letter(const char *a, const char *a_end, const char *b, const char *b_end)
+{
+    if (a_end-a != b_end-b) {
+        return false;
+    }
+    for (; a < a_end; a++, b++) {
+        if (toupper(*a) != toupper(*b)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int match(const char *good, const char *test)
+{
+    int n = 0;
+    int t = 0;
+    while (*good != 0 && *test != 0) {
+        if (isspace(*good)) {
+            while (*test != 0 && !isspace(*test)) {
+                test = next_letter(test);
+            }
+            if (isspace(*test)) {
+                test++;
+            }
+            good++;
+        } else {
+            const char *g = next_letter(good);
+            if (!isspace(*test)) {
+                const char *e = next_letter(test);
+                if (same_letter(good, g, test, e)) {
+                    t++;
+                }
+                test = e;
+            }
+            n++;
+            good = g;
+        }
+    }
+    return n > 0 ? 100*t/n : 0;
+}
+
+void make_groups(char *words, int size, int level, int count)
+{
+    int n = 0;
+    words[0] = 0;
+    for (int i = 0; i < count; i++) {
+        int len = static_cast<int>(urand()*5+2); //5*(1/-log(urand()));
+        int start = n;
+        for (int j = 0; j < len; j++) {
+            const char *l = Letters[static_cast<int>(urand()*level)];
+            int ll = static_cast<int>(strlen(l));
+            if (n + ll + 2 > size) {
+                words[start] = 0;
+                return;
+            }
+            memcpy(words+n, l, ll);
+            n += ll;
+        }
+        words[n++] = ' ';
+        words[n] = 0;
+    }
+}
+
+int next_level(int level, int score)
+{
+    if (score >= 90 && level < LEVEL_MAX) {
+        level++;
+    } else if (score < 50 && level > 2) {
+        level--;
+    }
+    return level;
+}
@@ -0,0 +1,24 @@
+#ifndef LESSON_H
+#define LESSON_H
+
+// The Koch method: letters are introduced in the order of Letters[], and
+// a student at level n is sent random groups of the first n of them. A
+// prosign is one letter, written as its name in angle brackets.
+
+extern const char *const Letters[];
+extern const int LEVEL_MAX;
+const int WMAX = 10;
+
+double urand();
+
+// Fills words with count random groups, each followed by a space, and
+// stops early rather than overflow size bytes.
+void make_groups(char *words, int size, int level, int count);
+
+// Percentage of the letters of good that were copied in test.
+int match(const char *good, const char *test);
+
+// The level to go on with after a round with the given score.
+int next_level(int level, int score);
+
+#endif
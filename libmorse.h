@@ -0,0 +1,68 @@
+#ifndef LIBMORSE_H
+#define LIBMORSE_H
+
+/* C interface to the encoder. Each morse_encoder is independent of every
+   other, so a program may create as many as it likes, with different
+   settings, and use them on different threads at once; a single encoder
+   must only be used by one thread at a time. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct morse_encoder morse_encoder;
+
+enum {
+    MORSE_U8,
+    MORSE_S16,
+    MORSE_F32
+};
+
+/* Receives samples as they are made, n of them in the format asked for. */
+typedef void (*morse_write_fn)(void *user, const void *samples, int n);
+
+/* An encoder that hands its samples to write. Returns NULL if a parameter
+   is out of range. shape is "linear" or "cosine"; wpm_chars is raised to
+   wpm_total if it is lower. */
+morse_encoder *morse_encoder_new(int sample_rate, int format, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape, morse_write_fn write, void *user);
+
+/* An encoder that writes to a file, or stdout for "-", of type "wav",
+   "rf64", "raw" or "flac". Returns NULL if a parameter is out of range or
+   the file cannot be opened. */
+morse_encoder *morse_encoder_new_file(int sample_rate, int format, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape, const char *path, const char *type);
+
+/* Adds the codes in a table file to those every encoder can send; see
+   tables/ for the format. Call it before making any encoder. Returns 0,
+   or -1 if the file cannot be read or is not a code table, which is
+   reported on stderr. */
+int morse_load_table(const char *path);
+
+/* What every encoder does with characters that have no code: leave them
+   out, send a question mark instead, or leave them out and report each
+   one on stderr the first time it is seen. Call it before making any
+   encoder. */
+enum {
+    MORSE_DROP,
+    MORSE_SUBSTITUTE,
+    MORSE_REPORT
+};
+void morse_set_unknown(int policy);
+
+/* Sends a line of text followed by a word gap. The text is UTF-8, or
+   Latin-1, and may contain prosigns written like <SK>. */
+void morse_encoder_send(morse_encoder *e, const char *text);
+
+/* Number of samples morse_encoder_send() would make for text. */
+long long morse_encoder_length(morse_encoder *e, const char *text);
+
+int morse_encoder_sample_rate(morse_encoder *e);
+void morse_encoder_flush(morse_encoder *e);
+
+/* Flushes the output and finishes any file. */
+void morse_encoder_free(morse_encoder *e);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
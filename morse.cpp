@@ -1,581 +1,498 @@
-#include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "cw.h"
+#include "encoder.h"
+#include "pcm.h"
+#include "stats.h"
+#include "synth.h"
+#include "thread.h"
 
 #ifndef _WIN32
 #include <unistd.h>
-#include <sys/ioctl.h>
-#endif
-
-#ifdef unix
-#include <sys/soundcard.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #ifdef _WIN32
-#include <windows.h>
 #define for if(0);else for
 #endif
 
-#ifdef __APPLE__
-#include <semaphore.h>
-#include <AudioToolbox/AudioQueue.h>
-#endif
-
-#ifndef M_PI
-double M_PI = 4*atan(1.0);
-#endif
-
 int WPM_chars = 18;
 int WPM_total = 5;
 int Freq = 750;
+int Amplitude = 16000;
+int SampleRate = 22050;
+const char *Shape = "linear";
 bool Verbose = false;
 bool Echo = false;
+int Latency = 50;
+int Period = 10;
+const char *Device = NULL;
 const char *OutputFile = NULL;
+const char *OutputType = "wav";
+const char *InputFile = NULL;
+int Threads = 0;
+bool Scheduled = false;
+double StatsInterval = 0;
+const char *StatsFile = NULL;
 
-int SPC_chars;
-int SPC_total;
-short *buf_silent;
-short buf_signal[20000];
-
-struct cw {
-    char c;
-    char code[8];
-} CW[] = {
-    {'A', ".-"},
-    {'B', "-..."},
-    {'C', "-.-."},
-    {'D', "-.."},
-    {'E', "."},
-    {'F', "..-."},
-    {'G', "--."},
-    {'H', "...."},
-    {'I', ".."},
-    {'J', ".---"},
-    {'K', "-.-"},
-    {'L', ".-.."},
-    {'M', "--"},
-    {'N', "-."},
-    {'O', "---"},
-    {'P', ".--."},
-    {'Q', "--.-"},
-    {'R', ".-."},
-    {'S', "..."},
-    {'T', "-"},
-    {'U', "..-"},
-    {'V', "...-"},
-    {'W', ".--"},
-    {'X', "-..-"},
-    {'Y', "-.--"},
-    {'Z', "--.."},
-    {'1', ".----"},
-    {'2', "..---"},
-    {'3', "...--"},
-    {'4', "....-"},
-    {'5', "....."},
-    {'6', "-...."},
-    {'7', "--..."},
-    {'8', "---.."},
-    {'9', "----."},
-    {'0', "-----"},
-    {',', "--..--"},
-    {'.', ".-.-.-"},
-    {'/', "-..-."},
-    {'?', "..--.."},
+SampleFormat Format = FORMAT_S16;
 
-    {';', "-.-.-"},
-    {':', "---..."},
-    {'-', "-....-"},
-    {'\'',".----."},
-    {'(', "-.--.-"},
-    {')', "-.--.-"},
-    {'_', "..--.-"},
-    {'', ".--.-"},
-    {'', ".-.-"},
-    {'', "..-.."},
-    {'', "--.--"},
-    {'', "---."},
-    {'', "..--"},
-};
+void morse(Encoder *encoder, const char *word)
+{
+    encoder->send(word, strlen(word));
+    encoder->flush();
+}
 
-const char *getcode(char c)
+// Reads a whole line however long it is, growing buf as needed.
+bool readline(FILE *f, char *&buf, int &size)
 {
-    for (int i = 0; i < sizeof(CW)/sizeof(CW[0]); i++) {
-        if (c == CW[i].c) {
-            return CW[i].code;
+    int len = 0;
+    for (;;) {
+        if (fgets(buf+len, size-len, f) == NULL) {
+            return len > 0;
+        }
+        len += strlen(buf+len);
+        if (buf[len-1] == '\n' || len < size-1) {
+            return true;
         }
+        char *newbuf = new char[size*2];
+        memcpy(newbuf, buf, len+1);
+        delete[] buf;
+        buf = newbuf;
+        size *= 2;
     }
-    return NULL;
 }
 
-class PcmOutput {
-public:
-    virtual ~PcmOutput() {}
-    virtual int getSampleRate() = 0;
-    virtual void output(const short *buf, int n) = 0;
-    virtual void flush() {}
-};
-
-#ifdef unix
-
-class PcmOutputUnix: public PcmOutput {
-public:
-    PcmOutputUnix(const char *dev);
-    virtual ~PcmOutputUnix();
-    virtual int getSampleRate();
-    virtual void output(const short *buf, int n);
-private:
-    int fd;
-    int sample_rate;
-};
+#ifndef _WIN32
 
-PcmOutputUnix::PcmOutputUnix(const char *dev)
+// Encodes the input file to the output file with both of them mapped
+// into memory. The output size is worked out up front from the symbol
+// cache, then every line is rendered directly into the mapped file,
+// which is the output of the encoder.
+void morse_mapped(Encoder *encoder, PcmOutputMapped *out, const char *fn)
 {
-    fd = open(dev, O_WRONLY);
+    int fd = open(fn, O_RDONLY);
     if (fd < 0) {
         perror("open");
         exit(1);
     }
-    int sndparam = AFMT_S16_LE;
-    if (ioctl(fd, SNDCTL_DSP_SETFMT, &sndparam) == -1) { 
-        perror("ioctl: SNDCTL_DSP_SETFMT");
-        exit(1);
-    }
-    if (sndparam != AFMT_S16_LE) {
-        perror("ioctl: SNDCTL_DSP_SETFMT");
-        exit(1);
-    }
-    sndparam = 0;
-    if (ioctl(fd, SNDCTL_DSP_STEREO, &sndparam) == -1) {
-        perror("ioctl: SNDCTL_DSP_STEREO");
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
         exit(1);
     }
-    if (sndparam != 0) {
-        fprintf(stderr, "gen: Error, cannot set the channel number to 0\n");
-        exit(1);
-    }
-    sample_rate = 22050;
-    sndparam = sample_rate;
-    if (ioctl(fd, SNDCTL_DSP_SPEED, &sndparam) == -1) {
-        perror("ioctl: SNDCTL_DSP_SPEED");
-        exit(1);
+    size_t size = st.st_size;
+    const char *text = "";
+    if (size > 0) {
+        void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        text = reinterpret_cast<const char *>(p);
+    }
+    const char *end = text + size;
+    long long total = 0;
+    long long carry = encoder->getCarry();
+    for (const char *p = text; p < end; ) {
+        const char *nl = reinterpret_cast<const char *>(memchr(p, '\n', end-p));
+        if (nl == NULL) {
+            nl = end;
+        }
+        total += encoder->length(p, nl-p, &carry);
+        p = nl + 1;
+    }
+    out->create(total);
+    for (const char *p = text; p < end; ) {
+        const char *nl = reinterpret_cast<const char *>(memchr(p, '\n', end-p));
+        if (nl == NULL) {
+            nl = end;
+        }
+        encoder->send(p, nl-p);
+        p = nl + 1;
     }
-    if ((10*abs(sndparam-sample_rate)) > sample_rate) {
-        perror("ioctl: SNDCTL_DSP_SPEED");
-        exit(1);
+    if (Echo) {
+        fwrite(text, 1, size, stdout);
     }
-    if (sndparam != sample_rate) {
-        fprintf(stderr, "Warning: Sampling rate is %u, requested %u\n", sndparam, sample_rate);
+    if (size > 0) {
+        munmap(const_cast<char *>(text), size);
     }
-}
-
-PcmOutputUnix::~PcmOutputUnix()
-{
     close(fd);
 }
 
-int PcmOutputUnix::getSampleRate()
-{
-    return sample_rate;
-}
-
-void PcmOutputUnix::output(const short *buf, int n)
-{
-    write(fd, buf, n*sizeof(short));
-}
-
-#endif // unix
+#endif // _WIN32
 
-class PcmOutputWav: public PcmOutput {
+// Renders a whole input file on a pool of worker threads. The input is
+// cut into chunks that are rendered into memory in parallel and written
+// to the output strictly in order. At most two chunks per thread are in
+// flight at any time, which bounds the memory used.
+class Renderer {
 public:
-    PcmOutputWav(const char *fn);
-    virtual ~PcmOutputWav();
-    virtual int getSampleRate() { return 22050; }
-    virtual void output(const short *buf, int n);
-    virtual void flush();
+    Renderer(Encoder *encoder, int nthreads, Stats *stats);
+    ~Renderer();
+    void run(FILE *f);
 private:
-    struct Header {
-        char tagRIFF[4];
-        unsigned long riffsize;
-        char tagWAVE[4];
-        char tagfmt[4];
-        unsigned long fmtsize;
-        unsigned short wFormatTag;
-        unsigned short nChannels;
-        unsigned long nSamplesPerSec;
-        unsigned long nAvgBytesPerSec;
-        unsigned short nBlockAlign;
-        unsigned short nBitsPerSample;
-        char tagdata[4];
-        unsigned long datasize;
+    struct Job {
+        char *text;
+        int len;
+        PcmOutputMemory *pcm;
+        long long carry;
+        double seconds;
+        int chars;
+        bool done;
     };
-    Header header;
-    int data_size;
-    FILE *f;
+    PcmOutput *out;
+    Synth *synth;
+    Stats *stats;
+    long long carry;
+    int nthreads;
+    Thread **threads;
+    int chunk;
+    char *rest; // the end of a chunk held over for the next one
+    int nrest;
+    int njobs;
+    Job *jobs;
+    int count;  // jobs read from the input
+    int next;   // next job for a worker
+    bool finished;
+    Mutex mutex;
+    Condition work;
+    Condition done;
+    static void worker(void *arg);
+    void advance(const Job &job);
+    void render(Job &job);
 };
 
-PcmOutputWav::PcmOutputWav(const char *fn)
+Renderer::Renderer(Encoder *encoder, int nthreads, Stats *stats)
+ : out(encoder->getOutput()), synth(encoder->getSynth()), stats(stats), carry(encoder->getCarry()), nthreads(nthreads), count(0), next(0), finished(false)
 {
-    data_size = 0;
-
-    strncpy(header.tagRIFF, "RIFF", 4);
-    header.riffsize = 0;
-    strncpy(header.tagWAVE, "WAVE", 4);
-    strncpy(header.tagfmt, "fmt ", 4);
-    header.fmtsize = 16;
-    header.wFormatTag = 1;
-    header.nChannels = 1;
-    header.nSamplesPerSec = 22050;
-    header.nAvgBytesPerSec = 22050*16/8*1;
-    header.nBlockAlign = 16/8;
-    header.nBitsPerSample = 16;
-    strncpy(header.tagdata, "data", 4);
-    header.datasize = 0;
-
-    f = fopen(fn, "wb");
-    if (f == NULL) {
-        perror("fopen");
-        exit(1);
+    // aim for about a million samples of output per chunk
+    chunk = (1 << 20) / (10*synth->getDotLength());
+    if (chunk < 64) {
+        chunk = 64;
+    }
+    rest = new char[chunk];
+    nrest = 0;
+    njobs = 2*nthreads;
+    jobs = new Job[njobs];
+    for (int i = 0; i < njobs; i++) {
+        jobs[i].text = new char[chunk];
+        jobs[i].len = 0;
+        jobs[i].pcm = new PcmOutputMemory(out->getSampleRate(), out->getSampleFormat());
+        jobs[i].done = false;
+    }
+    threads = new Thread *[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = new Thread(worker, this);
     }
-    fwrite(&header, 1, sizeof(header), f);
 }
 
-PcmOutputWav::~PcmOutputWav()
+Renderer::~Renderer()
 {
-    flush();
-    fclose(f);
+    mutex.lock();
+    finished = true;
+    work.broadcast();
+    mutex.unlock();
+    for (int i = 0; i < nthreads; i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    delete[] threads;
+    for (int i = 0; i < njobs; i++) {
+        delete[] jobs[i].text;
+        delete jobs[i].pcm;
+    }
+    delete[] jobs;
+    delete[] rest;
 }
 
-void PcmOutputWav::output(const short *buf, int n)
+// Where a chunk can end without cutting a character or a prosign in
+// two: after its last newline or space, or failing that before any
+// UTF-8 sequence or '<' that may not be finished.
+static int chunk_end(const char *text, int len)
 {
-    fwrite(buf, sizeof(short), n, f);
-    data_size += n*sizeof(short);
-}
-
-void PcmOutputWav::flush()
-{
-    header.riffsize = 36+data_size;
-    header.datasize = data_size;
-    fseek(f, 0, SEEK_SET);
-    fwrite(&header, 1, sizeof(header), f);
-    fseek(f, 0, SEEK_END);
-}
-
-#ifdef _WIN32
-
-class PcmOutputWin32: public PcmOutput {
-public:
-    PcmOutputWin32();
-    virtual ~PcmOutputWin32();
-    virtual int getSampleRate() { return 22050; }
-    virtual void output(const short *buf, int n);
-    virtual void flush();
-private:
-    HWAVEOUT wo;
-    struct Buffer {
-        bool prepared;
-        WAVEHDR hdr;
-        enum {SIZE = 16384};
-        short data[SIZE];
-        int index;
-    };
-    enum {NBUFS = 4};
-    Buffer buffers[NBUFS];
-    int bufindex;
-    int buftail;
-    void wait();
-};
-
-PcmOutputWin32::PcmOutputWin32()
-{
-    WAVEFORMATEX wf;
-    wf.wFormatTag = WAVE_FORMAT_PCM;
-    wf.nChannels = 1;
-    wf.nSamplesPerSec = 22050;
-    wf.nAvgBytesPerSec = 22050*16/8*1;
-    wf.nBlockAlign = 16/8;
-    wf.wBitsPerSample = 16;
-    wf.cbSize = 0;
-    MMRESULT r = waveOutOpen(&wo, WAVE_MAPPER, &wf, 0, 0, CALLBACK_NULL);
-    if (r != MMSYSERR_NOERROR) {
-        fprintf(stderr, "could not open wave device\n");
-        exit(1);
+    for (int i = len; i > 0; i--) {
+        if (text[i-1] == '\n' || text[i-1] == ' ') {
+            return i;
+        }
     }
-    for (int i = 0; i < NBUFS; i++) {
-        buffers[i].prepared = false;
-        buffers[i].hdr.lpData = (char *)buffers[i].data;
-        buffers[i].hdr.dwBufferLength = Buffer::SIZE*sizeof(short);
-        buffers[i].hdr.dwFlags = 0;
-        buffers[i].index = 0;
+    int end = len;
+    for (int i = len-1; i >= 0 && i >= len-MAX_PROSIGN-1; i--) {
+        if (text[i] == '<') {
+            end = i;
+        }
     }
-    bufindex = 0;
-    buftail = 0;
-}
-
-PcmOutputWin32::~PcmOutputWin32()
-{
-    flush();
-    waveOutReset(wo);
-    waveOutClose(wo);
+    for (int i = end-1; i >= 0 && i >= end-3; i--) {
+        unsigned char c = text[i];
+        if (c < 0x80) {
+            break;
+        } else if (c >= 0xc0) {
+            end = i;
+            break;
+        }
+    }
+    return end > 0 ? end : len;
 }
 
-void PcmOutputWin32::output(const short *buf, int n)
+void Renderer::run(FILE *f)
 {
-    while (n > 0) {
-        if (!buffers[bufindex].prepared) {
-            buffers[bufindex].hdr.dwBufferLength = Buffer::SIZE*sizeof(short);
-            buffers[bufindex].hdr.dwFlags = 0;
-            MMRESULT r = waveOutPrepareHeader(wo, &buffers[bufindex].hdr, sizeof(WAVEHDR));
-            if (r != MMSYSERR_NOERROR) {
-                fprintf(stderr, "error preparing header\n");
-                return;
+    int written = 0;
+    bool eof = false;
+    char last = '\n';
+    for (;;) {
+        while (!eof && count - written < njobs) {
+            Job &job = jobs[count % njobs];
+            memcpy(job.text, rest, nrest);
+            int n = static_cast<int>(fread(job.text+nrest, 1, chunk-nrest, f));
+            if (n < chunk-nrest) {
+                eof = true;
             }
-            buffers[bufindex].index = 0;
-            buffers[bufindex].prepared = true;
-        }
-        int c = Buffer::SIZE-buffers[bufindex].index;
-        if (c > n) {
-            c = n;
-        }
-        memcpy(buffers[bufindex].data+buffers[bufindex].index, buf, c*sizeof(short));
-        buffers[bufindex].index += c;
-        buf += c;
-        n -= c;
-        if (buffers[bufindex].index >= Buffer::SIZE) {
-            MMRESULT r = waveOutWrite(wo, &buffers[bufindex].hdr, sizeof(WAVEHDR));
-            if (r != MMSYSERR_NOERROR) {
-                fprintf(stderr, "error on waveOutWrite: %d\n", r);
-                return;
+            job.len = nrest + n;
+            nrest = 0;
+            if (job.len == 0) {
+                break;
             }
-            int newbufindex = (bufindex + 1) % NBUFS;
-            if (newbufindex == buftail) {
-                wait();
+            if (!eof) {
+                int end = chunk_end(job.text, job.len);
+                nrest = job.len - end;
+                memcpy(rest, job.text+end, nrest);
+                job.len = end;
             }
-            bufindex = newbufindex;
-            assert(bufindex != buftail);
+            last = job.text[job.len-1];
+            job.carry = carry;
+            advance(job);
+            mutex.lock();
+            job.done = false;
+            count++;
+            work.broadcast();
+            mutex.unlock();
+        }
+        if (written == count) {
+            break;
         }
+        Job &job = jobs[written % njobs];
+        mutex.lock();
+        while (!job.done) {
+            done.wait(mutex);
+        }
+        mutex.unlock();
+        job.pcm->replay(out);
+        if (stats != NULL) {
+            stats->chars += job.chars;
+            stats->send += job.seconds;
+        }
+        out->flush();
+        if (Echo) {
+            fwrite(job.text, 1, job.len, stdout);
+        }
+        written++;
+    }
+    if (last != '\n') {
+        synth->send(out, " ", 1, &carry);
+        out->flush();
     }
 }
 
-void PcmOutputWin32::flush()
+void Renderer::worker(void *arg)
 {
-    if (buffers[bufindex].prepared && buffers[bufindex].index > 0) {
-        buffers[bufindex].hdr.dwBufferLength = buffers[bufindex].index*sizeof(short);
-        MMRESULT r = waveOutWrite(wo, &buffers[bufindex].hdr, sizeof(WAVEHDR));
-        if (r != MMSYSERR_NOERROR) {
-            fprintf(stderr, "error on waveOutWrite: %d\n", r);
-            return;
+    Renderer *This = reinterpret_cast<Renderer *>(arg);
+    This->mutex.lock();
+    for (;;) {
+        while (This->next == This->count && !This->finished) {
+            This->work.wait(This->mutex);
         }
-        int newbufindex = (bufindex + 1) % NBUFS;
-        if (newbufindex == buftail) {
-            wait();
+        if (This->next == This->count) {
+            break;
         }
-        bufindex = newbufindex;
-        assert(bufindex != buftail);
-    }
-    while (buftail != bufindex) {
-        wait();
-    }
+        Job &job = This->jobs[This->next % This->njobs];
+        This->next++;
+        This->mutex.unlock();
+        This->render(job);
+        This->mutex.lock();
+        job.done = true;
+        This->done.broadcast();
+    }
+    This->mutex.unlock();
 }
 
-void PcmOutputWin32::wait()
+// Moves the carry on past a job, so that the next one can be rendered
+// from where this one will leave off before this one has been.
+void Renderer::advance(const Job &job)
 {
-    if (buftail == bufindex) {
-        return;
-    }
-    while ((buffers[buftail].hdr.dwFlags & WHDR_DONE) == 0) {
-        Sleep(100);
-    }
-    MMRESULT r = waveOutUnprepareHeader(wo, &buffers[buftail].hdr, sizeof(WAVEHDR));
-    if (r != MMSYSERR_NOERROR) {
-        fprintf(stderr, "error on waveOutUnprepareHeader: %d\n", r);
-        return;
+    const char *p = job.text;
+    const char *end = job.text + job.len;
+    while (p < end) {
+        const char *nl = reinterpret_cast<const char *>(memchr(p, '\n', end-p));
+        if (nl == NULL) {
+            synth->length(p, end-p, &carry);
+            break;
+        }
+        synth->length(p, nl-p, &carry);
+        synth->length(" ", 1, &carry);
+        p = nl + 1;
     }
-    buffers[buftail].prepared = false;
-    buftail = (buftail + 1) % NBUFS;
 }
 
-#endif // _WIN32
-
-#ifdef __APPLE__
+// Each line ends with a word gap, just as morse() adds one after each
+// line it is given, so the output matches the single threaded path. The
+// time taken is counted as sending time once the job is written out.
+void Renderer::render(Job &job)
+{
+    double start = monotonic();
+    job.pcm->clear();
+    const char *p = job.text;
+    const char *end = job.text + job.len;
+    long long carry = job.carry;
+    job.chars = 0;
+    while (p < end) {
+        const char *nl = reinterpret_cast<const char *>(memchr(p, '\n', end-p));
+        if (nl == NULL) {
+            job.chars += synth->send(job.pcm, p, end-p, &carry);
+            break;
+        }
+        job.chars += synth->send(job.pcm, p, nl-p, &carry);
+        synth->send(job.pcm, " ", 1, &carry);
+        p = nl + 1;
+    }
+    job.seconds = monotonic() - start;
+}
 
-class PcmOutputMacOSX: public PcmOutput {
+// Sends lines at the times they name. A line may start with a time and
+// a space:
+//   @1767225600.5  seconds since 1970
+//   +60            seconds after the last timed line, or the start
+//   12:00:00.5     the nearest such time of day, local time
+// and is then preceded by however much silence it takes for it to start
+// at that moment; other lines follow straight on. Times are kept on the
+// monotonic clock, so the system clock being set while running does not
+// move lines already read. On a sound device a line starts when its
+// first sample is heard, which is worked out from what the ring and
+// the device still have queued. Long waits are slept through with the
+// device drained, then padded out with silence for the last LEAD
+// seconds. Anything else is taken to start at the moment morse did, and
+// the silence puts each line at the right place in the file. A line
+// that cannot start on time starts as soon as it can, and is reported.
+class Scheduler {
 public:
-    PcmOutputMacOSX();
-    virtual ~PcmOutputMacOSX();
-    virtual int getSampleRate() { return 22050; }
-    virtual void output(const short *buf, int n);
-    virtual void flush();
+    Scheduler(Encoder *encoder, bool realtime);
+    void send(const char *line);
 private:
-    enum {
-        NBUFFERS = 3,
-        BUFFER_SIZE = 4096
-    };
-    short buffer[BUFFER_SIZE];
-    int index;
-    AudioQueueRef aq;
-    AudioQueueBufferRef buffers[NBUFFERS];
-    sem_t *sem_notfull;
-    sem_t *sem_full;
-    static void callback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer);
+    static const double LEAD;
+    Encoder *encoder;
+    bool realtime;
+    int sample_rate;
+    double start;
+    double last;
+    long long written;
+    bool parse(const char *&p, double &when);
+    double wait(double when);
 };
 
-PcmOutputMacOSX::PcmOutputMacOSX()
- : index(0), aq(NULL)
-{
-    sem_unlink("com.hewgill.morse.notfull");
-    sem_unlink("com.hewgill.morse.full");
-    sem_notfull = sem_open("com.hewgill.morse.notfull", O_CREAT|O_EXCL, 0700, 1);
-    if (sem_notfull == SEM_FAILED) {
-        perror("sem_open");
-        exit(1);
-    }
-    sem_full = sem_open("com.hewgill.morse.full", O_CREAT|O_EXCL, 0700, 0);
-    if (sem_full == SEM_FAILED) {
-        perror("sem_open");
-        exit(1);
-    }
-
-    AudioStreamBasicDescription format;
-    format.mSampleRate = getSampleRate();
-    format.mFormatID = kAudioFormatLinearPCM;
-    format.mFormatFlags = kLinearPCMFormatFlagIsSignedInteger | kLinearPCMFormatFlagIsPacked;
-    format.mBytesPerPacket = 2;
-    format.mFramesPerPacket = 1;
-    format.mBytesPerFrame = 2;
-    format.mChannelsPerFrame = 1;
-    format.mBitsPerChannel = 16;
-    format.mReserved = 0;
-    OSStatus status = AudioQueueNewOutput(&format, callback, this, NULL, NULL, 0, &aq);
-    if (status != 0) {
-        fprintf(stderr, "could not open output audio queue: %d\n", status);
-        exit(1);
-    }
-    for (int i = 0; i < NBUFFERS; i++) {
-        status = AudioQueueAllocateBuffer(aq, BUFFER_SIZE*2, &buffers[i]);
-        if (status != 0) {
-            fprintf(stderr, "could not allocate audio buffer: %d\n", status);
-            exit(1);
-        }
-        buffers[i]->mAudioDataByteSize = BUFFER_SIZE * sizeof(short);
-        memset(buffers[i]->mAudioData, 0, buffers[i]->mAudioDataByteSize);
-        AudioQueueEnqueueBuffer(aq, buffers[i], 0, NULL);
-    }
-    status = AudioQueueStart(aq, NULL);
-    if (status != 0) {
-        fprintf(stderr, "could not start output audio queue: %d\n", status);
-        exit(1);
-    }
-}
+const double Scheduler::LEAD = 0.25;
 
-PcmOutputMacOSX::~PcmOutputMacOSX()
+Scheduler::Scheduler(Encoder *encoder, bool realtime)
+ : encoder(encoder), realtime(realtime), written(0)
 {
-    //printf("destructor index=%d\n", index);
-    sem_wait(sem_notfull);
-    sem_post(sem_full);
-    sem_wait(sem_notfull);
-    if (aq != NULL) {
-        AudioQueueDispose(aq, false);
-    }
-    sem_close(sem_notfull);
-    sem_close(sem_full);
+    sample_rate = encoder->getOutput()->getSampleRate();
+    start = monotonic();
+    last = start;
 }
 
-void PcmOutputMacOSX::output(const short *buf, int n)
+// Reads a time off the front of a line, as a time on the monotonic
+// clock, leaving p at the text that follows.
+bool Scheduler::parse(const char *&p, double &when)
 {
-    while (n > 0) {
-        //printf("output %d index=%d\n", n, index);
-        sem_wait(sem_notfull);
-        int take = BUFFER_SIZE - index;
-        if (n < take) {
-            take = n;
+    char *end;
+    double now = monotonic();
+    if (*p == '@' || *p == '+') {
+        double t = strtod(p+1, &end);
+        if (end == p+1 || (*end != ' ' && *end != '\n' && *end != 0)) {
+            return false;
         }
-        memcpy(buffer + index, buf, take * sizeof(short));
-        index += take;
-        buf += take;
-        n -= take;
-        if (index < BUFFER_SIZE) {
-            sem_post(sem_notfull);
-        } else {
-            sem_post(sem_full);
+        when = *p == '@' ? now + (t - wallclock()) : last + t;
+    } else {
+        int h, m, n;
+        double sec;
+        if (sscanf(p, "%d:%d:%lf%n", &h, &m, &sec, &n) != 3 || (p[n] != ' ' && p[n] != '\n' && p[n] != 0)) {
+            return false;
+        }
+        end = const_cast<char *>(p) + n;
+        double wall = wallclock();
+        time_t t = static_cast<time_t>(wall);
+        struct tm tm = *localtime(&t);
+        tm.tm_hour = h;
+        tm.tm_min = m;
+        tm.tm_sec = 0;
+        double ahead = difftime(mktime(&tm), t) + sec - (wall - t);
+        if (ahead < -12*3600) {
+            ahead += 24*3600;
+        } else if (ahead > 12*3600) {
+            ahead -= 24*3600;
         }
+        when = now + ahead;
     }
+    p = *end == ' ' ? end+1 : end;
+    return true;
 }
 
-void PcmOutputMacOSX::flush()
+// Pads with silence up to the given time, and returns how late that
+// leaves the line.
+double Scheduler::wait(double when)
 {
-}
-
-void PcmOutputMacOSX::callback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
-{
-    //printf("callback %p\n", inBuffer);
-    PcmOutputMacOSX *This = reinterpret_cast<PcmOutputMacOSX *>(inUserData);
-    sem_wait(This->sem_full);
-    //printf("  index=%d\n", This->index);
-    inBuffer->mAudioDataByteSize = This->index * sizeof(short);
-    memcpy(inBuffer->mAudioData, This->buffer, inBuffer->mAudioDataByteSize);
-    AudioQueueEnqueueBuffer(This->aq, inBuffer, 0, NULL);
-    if (This->index < BUFFER_SIZE) {
-        //printf("stop\n");
-        AudioQueueStop(This->aq, false);
-    }
-    This->index = 0;
-    sem_post(This->sem_notfull);
-}
-
-#endif // __APPLE__
-
-PcmOutput *pcm;
-
-void pause(int w)
-{
-    while (w--) {
-        pcm->output(buf_silent, SPC_total);
+    for (;;) {
+        double left;
+        if (realtime) {
+            PcmOutput *out = encoder->getOutput();
+            left = when - monotonic() - double(out->getDelay())/sample_rate;
+            if (left > 2*LEAD) {
+                encoder->flush();
+                sleep_seconds(left - LEAD);
+                continue;
+            }
+        } else {
+            left = when - start - double(written)/sample_rate;
+        }
+        long long n = static_cast<long long>(left*sample_rate + 0.5);
+        if (n < 0) {
+            return -left;
+        }
+        // within the reach of an int, as ahead of time as it takes
+        while (n > 0) {
+            int c = n < (1 << 24) ? static_cast<int>(n) : (1 << 24);
+            encoder->pause(c);
+            written += c;
+            n -= c;
+        }
+        return 0;
     }
 }
 
-void tone(int w)
+void Scheduler::send(const char *line)
 {
-    const int RAMP = 110;
-    short ramp[RAMP];
-    memcpy(ramp, buf_signal, sizeof(ramp));
-    for (int i = 0; i < RAMP; i++) {
-        ramp[i] = ramp[i]*i/RAMP;
-    }
-    pcm->output(ramp, RAMP);
-    pcm->output(buf_signal+RAMP, w*SPC_chars-2*RAMP);
-    memcpy(ramp, buf_signal+w*SPC_chars-RAMP, sizeof(ramp));
-    for (int i = 0; i < RAMP; i++) {
-        ramp[i] = ramp[i]*(RAMP-i-1)/RAMP;
-    }
-    pcm->output(ramp, RAMP);
-    pcm->output(buf_silent, SPC_chars);
-}
-
-void morse(const char *word)
-{
-    for (const char *p = word; *p != 0; p++) {
-        if (*p == ' ') {
-            pause(7);
-        } else {
-            const char *cw = getcode(toupper(*p));
-            if (cw != NULL) {
-                for (const char *c = cw; *c != 0; c++) {
-                    if (*c == '.') {
-                        tone(1);
-                    } else {
-                        tone(3);
-                    }
-                }
-                pause(3);
+    const char *text = line;
+    double when;
+    if (parse(text, when)) {
+        last = when;
+        double late = wait(when);
+        if (late >= 0.001 || Verbose) {
+            fprintf(stderr, "%.3f late %.1fms: %s", wallclock() + (when - monotonic()), late*1000, text);
+            if (strchr(text, '\n') == NULL) {
+                fputc('\n', stderr);
             }
         }
     }
-    pause(7);
-    pcm->flush();
+    int len = strlen(text);
+    written += encoder->length(text, len);
+    encoder->send(text, len);
+    encoder->flush();
 }
 
 int main(int argc, char *argv[])
@@ -583,6 +500,35 @@ int main(int argc, char *argv[])
     int a = 1;
     while (a < argc && argv[a][0] == '-') {
         switch (argv[a][1]) {
+        case 'a':
+            if (argv[a][2]) {
+                Amplitude = atoi(argv[a]+2);
+            } else {
+                a++;
+                Amplitude = atoi(argv[a]);
+            }
+            break;
+        case 'b':
+            {
+                const char *bits;
+                if (argv[a][2]) {
+                    bits = &argv[a][2];
+                } else {
+                    a++;
+                    bits = argv[a];
+                }
+                if (strcmp(bits, "8") == 0) {
+                    Format = FORMAT_U8;
+                } else if (strcmp(bits, "16") == 0) {
+                    Format = FORMAT_S16;
+                } else if (strcmp(bits, "32") == 0 || strcmp(bits, "float") == 0) {
+                    Format = FORMAT_F32;
+                } else {
+                    fprintf(stderr, "%s: invalid sample format %s\n", argv[0], bits);
+                    exit(1);
+                }
+            }
+            break;
         case 'c':
             if (argv[a][2]) {
                 WPM_chars = atoi(argv[a]+2);
@@ -591,6 +537,14 @@ int main(int argc, char *argv[])
                 WPM_chars = atoi(argv[a]);
             }
             break;
+        case 'd':
+            if (argv[a][2]) {
+                Device = &argv[a][2];
+            } else {
+                a++;
+                Device = argv[a];
+            }
+            break;
         case 'e':
             Echo = true;
             break;
@@ -602,6 +556,59 @@ int main(int argc, char *argv[])
                 Freq = atoi(argv[a]);
             }
             break;
+        case 'i':
+            if (argv[a][2]) {
+                InputFile = &argv[a][2];
+            } else {
+                a++;
+                InputFile = argv[a];
+            }
+            break;
+        case 'j':
+            if (argv[a][2]) {
+                Threads = atoi(argv[a]+2);
+            } else {
+                a++;
+                Threads = atoi(argv[a]);
+            }
+            break;
+        case 'l':
+            if (argv[a][2]) {
+                Latency = atoi(argv[a]+2);
+            } else {
+                a++;
+                Latency = atoi(argv[a]);
+            }
+            break;
+        case 'L':
+            Encoder::init();
+            if (argv[a][2]) {
+                if (!load_codes(&argv[a][2])) {
+                    exit(1);
+                }
+            } else {
+                a++;
+                if (!load_codes(argv[a])) {
+                    exit(1);
+                }
+            }
+            break;
+        case 'm':
+            if (argv[a][2]) {
+                StatsInterval = atof(argv[a]+2);
+            } else {
+                a++;
+                StatsInterval = atof(argv[a]);
+            }
+            break;
+        case 'M':
+            if (argv[a][2]) {
+                StatsFile = &argv[a][2];
+            } else {
+                a++;
+                StatsFile = argv[a];
+            }
+            break;
         case 'o':
             if (argv[a][2]) {
                 OutputFile = &argv[a][2];
@@ -610,6 +617,71 @@ int main(int argc, char *argv[])
                 OutputFile = argv[a];
             }
             break;
+        case 'p':
+            if (argv[a][2]) {
+                Period = atoi(argv[a]+2);
+            } else {
+                a++;
+                Period = atoi(argv[a]);
+            }
+            break;
+        case 'r':
+            if (argv[a][2]) {
+                SampleRate = atoi(argv[a]+2);
+            } else {
+                a++;
+                SampleRate = atoi(argv[a]);
+            }
+            break;
+        case 's':
+            if (argv[a][2]) {
+                Shape = &argv[a][2];
+            } else {
+                a++;
+                Shape = argv[a];
+            }
+            if (strcmp(Shape, "linear") != 0 && strcmp(Shape, "cosine") != 0) {
+                fprintf(stderr, "%s: invalid ramp shape %s\n", argv[0], Shape);
+                exit(1);
+            }
+            break;
+        case 't':
+            if (argv[a][2]) {
+                OutputType = &argv[a][2];
+            } else {
+                a++;
+                OutputType = argv[a];
+            }
+            if (strcmp(OutputType, "wav") != 0 && strcmp(OutputType, "rf64") != 0 && strcmp(OutputType, "raw") != 0 && strcmp(OutputType, "flac") != 0 && strcmp(OutputType, "null") != 0) {
+                fprintf(stderr, "%s: invalid output type %s\n", argv[0], OutputType);
+                exit(1);
+            }
+            break;
+        case 'T':
+            Scheduled = true;
+            break;
+        case 'u':
+            {
+                const char *policy;
+                if (argv[a][2]) {
+                    policy = &argv[a][2];
+                } else {
+                    a++;
+                    policy = argv[a];
+                }
+                Encoder::init();
+                if (strcmp(policy, "drop") == 0) {
+                    set_unknown(UNKNOWN_DROP);
+                } else if (strcmp(policy, "sub") == 0) {
+                    set_unknown(UNKNOWN_SUBSTITUTE);
+                } else if (strcmp(policy, "report") == 0) {
+                    set_unknown(UNKNOWN_REPORT);
+                } else {
+                    fprintf(stderr, "%s: invalid policy for unknown characters %s\n", argv[0], policy);
+                    exit(1);
+                }
+            }
+            break;
         case 'v':
             Verbose = true;
             break;
@@ -634,47 +706,135 @@ int main(int argc, char *argv[])
         fprintf(stderr, "%s: Invalid wpm parameter\n", argv[0]);
         exit(1);
     }
+    if (SampleRate < 1000 || Freq <= 0 || 2*Freq >= SampleRate) {
+        fprintf(stderr, "%s: Invalid sample rate or frequency\n", argv[0]);
+        exit(1);
+    }
+    if (Period < 1 || Latency < 1) {
+        fprintf(stderr, "%s: Invalid latency or period\n", argv[0]);
+        exit(1);
+    }
     if (Verbose) {
         fprintf(stderr, "%d WPM (%d WPM chars)\n", WPM_total, WPM_chars);
     }
-    if (OutputFile) {
-        pcm = new PcmOutputWav(OutputFile);
-    } else {
-#if defined(unix)
-        pcm = new PcmOutputUnix("/dev/dsp");
-#elif defined(_WIN32)
-        pcm = new PcmOutputWin32();
-#elif defined(__APPLE__)
-        pcm = new PcmOutputMacOSX();
-#else
-        #error unsupported platform
+    PcmOutput *pcm;
+    PcmOutputRing *ring = NULL;
+    bool flac = strcmp(OutputType, "flac") == 0;
+    bool discard = strcmp(OutputType, "null") == 0;
+    if (flac && Format == FORMAT_F32) {
+        fprintf(stderr, "%s: FLAC cannot hold float samples\n", argv[0]);
+        exit(1);
+    }
+    // stdout, a pipe and raw samples are streamed out as they are made
+    bool stream = OutputFile && !flac && (strcmp(OutputFile, "-") == 0 || strcmp(OutputType, "raw") == 0);
+#ifndef _WIN32
+    struct stat st;
+    if (OutputFile && !flac && stat(OutputFile, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        stream = true;
+    }
+    PcmOutputMapped *mapped = NULL;
+    if (OutputFile && InputFile && Threads == 0 && !Scheduled && a >= argc && !stream && !flac && !discard && StatsInterval == 0 && StatsFile == NULL) {
+        mapped = new PcmOutputMapped(OutputFile, SampleRate, Format);
+        pcm = mapped;
+    } else
 #endif
+    if (discard) {
+        pcm = new PcmOutputNull(SampleRate, Format);
+    } else if (OutputFile && flac) {
+        pcm = new PcmOutputFlac(OutputFile, SampleRate, Format);
+    } else if (stream) {
+        pcm = new PcmOutputStream(OutputFile, SampleRate, Format, strcmp(OutputType, "raw") != 0);
+    } else if (OutputFile) {
+        pcm = new PcmOutputBuffered(new PcmOutputWav(OutputFile, SampleRate, Format, strcmp(OutputType, "rf64") == 0), 65536);
+    } else {
+        PcmOutput *dev = open_device(Device, SampleRate, Format);
+        ring = new PcmOutputRing(dev, dev->getSampleRate()*Period/1000, Latency/Period);
+        pcm = ring;
     }
-    int sample_rate = pcm->getSampleRate();
-    SPC_chars = (sample_rate*60)/(WPM_chars*50);
-    SPC_total = ((sample_rate*60)/WPM_total - SPC_chars*31) / 19;
-    buf_silent = new short[SPC_total];
-    memset(buf_silent, 0, SPC_total*sizeof(short));
-    for (int i = 0; i < sizeof(buf_signal)/sizeof(short); i++) {
-        buf_signal[i] = static_cast<short>(16000*sin(Freq*2*M_PI*i/sample_rate));
+    Stats stats;
+    bool instrument = StatsInterval > 0 || StatsFile != NULL;
+    if (instrument) {
+        pcm = new PcmOutputStats(pcm, &stats, StatsInterval);
+        stats.ring = ring;
+    }
+    Encoder *encoder = new Encoder(pcm, WPM_chars, WPM_total, Freq, Amplitude, Shape, instrument ? &stats : NULL);
+#ifndef _WIN32
+    if (mapped != NULL) {
+        morse_mapped(encoder, mapped, InputFile);
+        delete encoder;
+        return 0;
     }
+#endif
+    Scheduler *scheduler = Scheduled ? new Scheduler(encoder, ring != NULL) : NULL;
     if (a < argc) {
         while (a < argc) {
-            morse(argv[a]);
+            if (scheduler != NULL) {
+                scheduler->send(argv[a]);
+            } else {
+                morse(encoder, argv[a]);
+            }
             if (Echo) {
                 printf("%s\n", argv[a]);
             }
             a++;
         }
     } else {
-        char buf[1024];
-        while (fgets(buf, sizeof(buf), stdin)) {
-            morse(buf);
-            if (Echo) {
-                fputs(buf, stdout);
+        FILE *in = stdin;
+        if (InputFile) {
+            in = fopen(InputFile, "r");
+            if (in == NULL) {
+                perror("fopen");
+                exit(1);
+            }
+        }
+        if (scheduler != NULL) {
+            int size = 1024;
+            char *buf = new char[size];
+            while (readline(in, buf, size)) {
+                scheduler->send(buf);
+                if (Echo) {
+                    fputs(buf, stdout);
+                    fflush(stdout);
+                }
+            }
+            delete[] buf;
+        } else if (Threads > 0) {
+            Renderer renderer(encoder, Threads, instrument ? &stats : NULL);
+            renderer.run(in);
+        } else {
+            int size = 1024;
+            char *buf = new char[size];
+            while (readline(in, buf, size)) {
+                morse(encoder, buf);
+                if (Echo) {
+                    fputs(buf, stdout);
+                }
             }
+            delete[] buf;
+        }
+        if (in != stdin) {
+            fclose(in);
+        }
+    }
+    delete scheduler;
+    encoder->flush();
+    if (ring != NULL && Verbose) {
+        fprintf(stderr, "latency %.1fms mean, %.1fms max, %d underruns\n", ring->getMeanLatency()*1000, ring->getMaxLatency()*1000, ring->getUnderruns());
+    }
+    if (StatsInterval > 0) {
+        stats.line(stderr);
+    }
+    if (StatsFile != NULL) {
+        FILE *f = strcmp(StatsFile, "-") == 0 ? stdout : fopen(StatsFile, "w");
+        if (f == NULL) {
+            perror(StatsFile);
+            exit(1);
+        }
+        stats.json(f);
+        if (f != stdout) {
+            fclose(f);
         }
     }
-    delete pcm;
+    delete encoder;
     return 0;
 }
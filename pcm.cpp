@@ -0,0 +1,1913 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcm.h"
+#include "thread.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef unix
+#include <sys/soundcard.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#define for if(0);else for
+#endif
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef __APPLE__
+#include <semaphore.h>
+#include <AudioToolbox/AudioQueue.h>
+#endif
+
+int sample_size(SampleFormat format)
+{
+    switch (format) {
+    case FORMAT_U8:
+        return 1;
+    case FORMAT_F32:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+void fill_silence(void *buf, SampleFormat format, int n)
+{
+    memset(buf, format == FORMAT_U8 ? 0x80 : 0, n*sample_size(format));
+}
+
+// Outputs that can represent a run of silence more cheaply than by
+// writing silent samples override silence(); this is the fallback.
+void PcmOutput::silence(int n)
+{
+    enum {BLOCK = 4096};
+    float block[BLOCK];
+    SampleFormat format = getSampleFormat();
+    fill_silence(block, format, n < BLOCK ? n : BLOCK);
+    while (n > 0) {
+        int c = BLOCK;
+        if (c > n) {
+            c = n;
+        }
+        output(block, c);
+        n -= c;
+    }
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = reinterpret_cast<const char *>(buf);
+    while (len > 0) {
+        long r = write(fd, p, static_cast<unsigned>(len));
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        p += r;
+        len -= r;
+    }
+}
+
+#ifdef unix
+
+class PcmOutputUnix: public PcmOutput {
+public:
+    PcmOutputUnix(int fd, int sample_rate, SampleFormat format);
+    virtual ~PcmOutputUnix();
+    virtual int getSampleRate();
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void reset();
+    virtual int getDelay();
+private:
+    int fd;
+    int sample_rate;
+    SampleFormat format;
+};
+
+PcmOutputUnix::PcmOutputUnix(int fd, int sample_rate, SampleFormat format)
+ : fd(fd)
+{
+    // OSS has no float samples, so those are sent as 16 bit instead
+    int sndparam = format == FORMAT_U8 ? AFMT_U8 : AFMT_S16_LE;
+    if (ioctl(fd, SNDCTL_DSP_SETFMT, &sndparam) == -1) { 
+        perror("ioctl: SNDCTL_DSP_SETFMT");
+        exit(1);
+    }
+    if (sndparam == AFMT_U8) {
+        this->format = FORMAT_U8;
+    } else if (sndparam == AFMT_S16_LE) {
+        this->format = FORMAT_S16;
+    } else {
+        perror("ioctl: SNDCTL_DSP_SETFMT");
+        exit(1);
+    }
+    sndparam = 0;
+    if (ioctl(fd, SNDCTL_DSP_STEREO, &sndparam) == -1) {
+        perror("ioctl: SNDCTL_DSP_STEREO");
+        exit(1);
+    }
+    if (sndparam != 0) {
+        fprintf(stderr, "gen: Error, cannot set the channel number to 0\n");
+        exit(1);
+    }
+    sndparam = sample_rate;
+    if (ioctl(fd, SNDCTL_DSP_SPEED, &sndparam) == -1) {
+        perror("ioctl: SNDCTL_DSP_SPEED");
+        exit(1);
+    }
+    if ((10*abs(sndparam-sample_rate)) > sample_rate) {
+        perror("ioctl: SNDCTL_DSP_SPEED");
+        exit(1);
+    }
+    if (sndparam != sample_rate) {
+        fprintf(stderr, "Warning: Sampling rate is %u, requested %u\n", sndparam, sample_rate);
+    }
+    this->sample_rate = sndparam;
+}
+
+PcmOutputUnix::~PcmOutputUnix()
+{
+    close(fd);
+}
+
+int PcmOutputUnix::getSampleRate()
+{
+    return sample_rate;
+}
+
+void PcmOutputUnix::output(const void *buf, int n)
+{
+    write_all(fd, buf, n*sample_size(format));
+}
+
+void PcmOutputUnix::reset()
+{
+    ioctl(fd, SNDCTL_DSP_RESET, 0);
+}
+
+int PcmOutputUnix::getDelay()
+{
+    int delay;
+    if (ioctl(fd, SNDCTL_DSP_GETODELAY, &delay) == -1) {
+        return 0;
+    }
+    return delay/sample_size(format);
+}
+
+#endif // unix
+
+#ifndef _WIN32
+
+// Plays the part of a sound device with a buffer of BUFFER seconds:
+// samples are written straight to a file or pipe, but output() then
+// waits until no more than a buffer's worth of them are still to play.
+// Running out of samples restarts its clock, as a device would.
+class PcmOutputPaced: public PcmOutput {
+public:
+    PcmOutputPaced(int fd, int sample_rate, SampleFormat format);
+    virtual ~PcmOutputPaced();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void flush();
+    virtual void reset();
+    virtual int getDelay();
+private:
+    static const double BUFFER;
+    int fd;
+    int sample_rate;
+    SampleFormat format;
+    double start;
+    long long written;
+    double ahead();
+};
+
+const double PcmOutputPaced::BUFFER = 0.02;
+
+PcmOutputPaced::PcmOutputPaced(int fd, int sample_rate, SampleFormat format)
+ : fd(fd), sample_rate(sample_rate), format(format), start(0), written(0)
+{
+}
+
+PcmOutputPaced::~PcmOutputPaced()
+{
+    close(fd);
+}
+
+// Seconds of output still to play.
+double PcmOutputPaced::ahead()
+{
+    return start + double(written)/sample_rate - monotonic();
+}
+
+void PcmOutputPaced::output(const void *buf, int n)
+{
+    if (ahead() < 0) {
+        start = monotonic();
+        written = 0;
+    }
+    write_all(fd, buf, n*sample_size(format));
+    written += n;
+    sleep_seconds(ahead() - BUFFER);
+}
+
+void PcmOutputPaced::flush()
+{
+    sleep_seconds(ahead());
+}
+
+// What has been written cannot be taken back, but at least it no longer
+// holds up what comes next.
+void PcmOutputPaced::reset()
+{
+    start = 0;
+    written = 0;
+}
+
+int PcmOutputPaced::getDelay()
+{
+    double t = ahead();
+    return t > 0 ? static_cast<int>(t*sample_rate) : 0;
+}
+
+#endif // _WIN32
+
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    put16(p, v & 0xffff);
+    put16(p+2, (v >> 16) & 0xffff);
+}
+
+static void put64(unsigned char *p, unsigned long long v)
+{
+    put32(p, static_cast<unsigned long>(v & 0xffffffff));
+    put32(p+4, static_cast<unsigned long>(v >> 32));
+}
+
+PcmOutputWav::PcmOutputWav(const char *fn, int sample_rate, SampleFormat format, bool rf64)
+ : sample_rate(sample_rate), format(format), rf64(rf64), data_size(0), pending(0)
+{
+    f = fopen(fn, "wb");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    start();
+}
+
+// Takes over a file the caller has opened, for callers that must carry on
+// when it cannot be.
+PcmOutputWav::PcmOutputWav(FILE *f, int sample_rate, SampleFormat format, bool rf64)
+ : sample_rate(sample_rate), format(format), rf64(rf64), data_size(0), pending(0), f(f)
+{
+    start();
+}
+
+void PcmOutputWav::start()
+{
+    // A pipe cannot have its header patched afterwards, so it gets the
+    // sizes meaning "until the end of the stream" up front, and its
+    // silence written out in full.
+    seekable = fseek(f, 0, SEEK_CUR) == 0;
+    unsigned char header[HEADER_MAX];
+    int size = seekable ? makeHeader(header, sample_rate, format, 0, rf64) : makeHeader(header, sample_rate, format, ~0ULL, false);
+    fwrite(header, 1, size, f);
+}
+
+// Fills in the header for a file holding data_size bytes of samples and
+// returns its length.
+int PcmOutputWav::makeHeader(unsigned char *buf, int sample_rate, SampleFormat format, unsigned long long data_size, bool rf64)
+{
+    const unsigned long long LIMIT = 0xffffffffULL - HEADER_MAX;
+    int size = sample_size(format);
+    // float samples are not PCM, so their fmt chunk has the extension
+    // size field and is followed by a fact chunk with the sample count
+    bool pcm = format != FORMAT_F32;
+    unsigned long long riff_size = (rf64 ? 72 : 36) + (pcm ? 0 : 14) + data_size + (data_size & 1);
+    bool large = data_size > LIMIT;
+    unsigned char *p = buf;
+    memcpy(p, large && rf64 ? "RF64" : "RIFF", 4);
+    put32(p+4, large ? 0xffffffff : static_cast<unsigned long>(riff_size));
+    memcpy(p+8, "WAVE", 4);
+    p += 12;
+    if (rf64) {
+        memset(p, 0, 36);
+        memcpy(p, large ? "ds64" : "JUNK", 4);
+        put32(p+4, 28);
+        if (large) {
+            put64(p+8, riff_size);
+            put64(p+16, data_size);
+            put64(p+24, data_size/size);
+        }
+        p += 36;
+    }
+    memcpy(p, "fmt ", 4);
+    put32(p+4, pcm ? 16 : 18);
+    put16(p+8, pcm ? 1 : 3);
+    put16(p+10, 1);
+    put32(p+12, sample_rate);
+    put32(p+16, sample_rate*size*1);
+    put16(p+20, size);
+    put16(p+22, size*8);
+    p += 24;
+    if (!pcm) {
+        put16(p, 0);
+        memcpy(p+2, "fact", 4);
+        put32(p+6, 4);
+        put32(p+10, large ? 0xffffffff : static_cast<unsigned long>(data_size/size));
+        p += 14;
+    }
+    memcpy(p, "data", 4);
+    put32(p+4, large ? 0xffffffff : static_cast<unsigned long>(data_size));
+    p += 8;
+    return static_cast<int>(p - buf);
+}
+
+PcmOutputWav::~PcmOutputWav()
+{
+    if (pending > 0) {
+        // a hole at the very end of the file needs a sample after it
+        pending--;
+        skip();
+        static const char zero[4] = {0};
+        fwrite(zero, sample_size(format), 1, f);
+    }
+    if (data_size & 1) {
+        fputc(0, f);
+    }
+    if (seekable) {
+        if (!rf64 && data_size > 0xffffffffULL - HEADER_MAX) {
+            fprintf(stderr, "Warning: WAV data exceeds 4GB, use -t rf64 for files this large\n");
+        }
+        unsigned char header[HEADER_MAX];
+        fseek(f, 0, SEEK_SET);
+        fwrite(header, 1, makeHeader(header, sample_rate, format, data_size, rf64), f);
+    }
+    fclose(f);
+}
+
+void PcmOutputWav::output(const void *buf, int n)
+{
+    if (pending > 0) {
+        skip();
+    }
+    fwrite(buf, sample_size(format), n, f);
+    data_size += n*sample_size(format);
+}
+
+// Silence is not written out at all, just remembered. The next output()
+// seeks over it, leaving a hole that reads back as zeros. That does not
+// work for 8 bit samples, whose silence is not zero.
+void PcmOutputWav::silence(int n)
+{
+    if (format == FORMAT_U8 || !seekable) {
+        PcmOutput::silence(n);
+        return;
+    }
+    pending += n;
+    data_size += n*sample_size(format);
+}
+
+void PcmOutputWav::skip()
+{
+    fseek(f, static_cast<long>(pending*sample_size(format)), SEEK_CUR);
+    pending = 0;
+}
+
+// The header is only patched when the file is closed, so there is
+// nothing to do here beyond passing on what we have written so far.
+void PcmOutputWav::flush()
+{
+    fflush(f);
+}
+
+// Tables for the CRC-8 (polynomial 0x07) that ends a FLAC frame header
+// and the CRC-16 (0x8005) that ends the frame, built before main().
+static unsigned char crc8_table[256];
+static unsigned short crc16_table[256];
+
+static struct CrcTables {
+    CrcTables() {
+        for (int i = 0; i < 256; i++) {
+            unsigned c8 = i;
+            unsigned c16 = i << 8;
+            for (int j = 0; j < 8; j++) {
+                c8 = (c8 << 1) ^ (c8 & 0x80 ? 0x07 : 0);
+                c16 = (c16 << 1) ^ (c16 & 0x8000 ? 0x8005 : 0);
+            }
+            crc8_table[i] = c8 & 0xff;
+            crc16_table[i] = c16 & 0xffff;
+        }
+    }
+} crc_tables;
+
+static unsigned crc8(const unsigned char *p, int n)
+{
+    unsigned crc = 0;
+    for (int i = 0; i < n; i++) {
+        crc = crc8_table[crc ^ p[i]];
+    }
+    return crc;
+}
+
+static unsigned crc16(const unsigned char *p, int n, unsigned crc)
+{
+    for (int i = 0; i < n; i++) {
+        crc = ((crc << 8) ^ crc16_table[(crc >> 8) ^ p[i]]) & 0xffff;
+    }
+    return crc;
+}
+
+// Big endian bit writer.
+class PcmOutputFlac::Bits {
+public:
+    Bits() : size(4096), len(0), acc(0), nacc(0) { buf = new unsigned char[size]; }
+    ~Bits() { delete[] buf; }
+    void clear() { len = 0; nacc = 0; }
+    const unsigned char *data() { return buf; }
+    int length() { return len; }
+    void put(unsigned v, int n)
+    {
+        acc = (acc << n) | (v & ((1ULL << n) - 1));
+        nacc += n;
+        while (nacc >= 8) {
+            nacc -= 8;
+            byte(static_cast<unsigned char>(acc >> nacc));
+        }
+    }
+    void zeros(unsigned n)
+    {
+        for (; n > 24; n -= 24) {
+            put(0, 24);
+        }
+        put(0, n);
+    }
+    void align()
+    {
+        if (nacc > 0) {
+            put(0, 8-nacc);
+        }
+    }
+private:
+    unsigned char *buf;
+    int size;
+    int len;
+    unsigned long long acc;
+    int nacc;
+    void byte(unsigned char c)
+    {
+        if (len >= size) {
+            unsigned char *b = new unsigned char[size*2];
+            memcpy(b, buf, len);
+            delete[] buf;
+            buf = b;
+            size *= 2;
+        }
+        buf[len++] = c;
+    }
+};
+
+PcmOutputFlac::PcmOutputFlac(const char *fn, int sample_rate, SampleFormat format)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format)), bps(bytes*8), position(0), min_frame(0), max_frame(0), npending(0), ncached(0)
+{
+    if (strcmp(fn, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        f = stdout;
+    } else {
+        f = fopen(fn, "wb");
+        if (f == NULL) {
+            perror("fopen");
+            exit(1);
+        }
+    }
+    start();
+}
+
+PcmOutputFlac::PcmOutputFlac(FILE *f, int sample_rate, SampleFormat format)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format)), bps(bytes*8), f(f), position(0), min_frame(0), max_frame(0), npending(0), ncached(0)
+{
+    start();
+}
+
+void PcmOutputFlac::start()
+{
+    if (format == FORMAT_F32) {
+        fprintf(stderr, "FLAC cannot hold float samples\n");
+        exit(1);
+    }
+    // the header is written again with the totals at the end, if it can be
+    seekable = f != stdout && fseek(f, 0, SEEK_CUR) == 0;
+    pending = new char[MAX_BLOCK*bytes];
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        residual[i] = new int[MAX_BLOCK];
+    }
+    lpc_residual[0] = new int[MAX_BLOCK];
+    lpc_residual[1] = new int[MAX_BLOCK];
+    bits = new Bits;
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        cache[i] = NULL;
+    }
+    writeHeader();
+}
+
+PcmOutputFlac::~PcmOutputFlac()
+{
+    drain();
+    if (seekable) {
+        fseek(f, 0, SEEK_SET);
+        writeHeader();
+    }
+    if (f == stdout) {
+        fflush(f);
+    } else {
+        fclose(f);
+    }
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        while (cache[i] != NULL) {
+            Cached *c = cache[i];
+            cache[i] = c->next;
+            delete[] c->samples;
+            delete[] c->data;
+            delete c;
+        }
+    }
+    delete bits;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        delete[] residual[i];
+    }
+    delete[] lpc_residual[0];
+    delete[] lpc_residual[1];
+    delete[] pending;
+}
+
+// The "fLaC" marker and a STREAMINFO block. Sizes not known yet are
+// left as zero, which means unknown, and so is the MD5 signature.
+void PcmOutputFlac::writeHeader()
+{
+    Bits b;
+    b.put(0x664c6143, 32);
+    b.put(0x80, 8);
+    b.put(34, 24);
+    b.put(MIN_BLOCK, 16);
+    b.put(MAX_BLOCK, 16);
+    b.put(min_frame, 24);
+    b.put(max_frame, 24);
+    b.put(sample_rate, 20);
+    b.put(0, 3);
+    b.put(bps-1, 5);
+    b.put(static_cast<unsigned>(position >> 32), 4);
+    b.put(static_cast<unsigned>(position & 0xffffffff), 32);
+    for (int i = 0; i < 4; i++) {
+        b.put(0, 32);
+    }
+    fwrite(b.data(), 1, b.length(), f);
+}
+
+// The length of the next frame to cut from a run of n samples. Frames
+// are kept to multiples of 64 samples where possible, which leaves room
+// to partition the residual, and never shorter than MIN_BLOCK.
+int PcmOutputFlac::chunk(int n)
+{
+    int c = n < MAX_BLOCK ? n : MAX_BLOCK;
+    if (c > 64) {
+        c &= ~63;
+    }
+    int r = n - c;
+    if (r > 0 && r < MIN_BLOCK) {
+        c = c > 64 ? c - 64 : n;
+    }
+    return c;
+}
+
+void PcmOutputFlac::output(const void *samples, int n)
+{
+    const char *buf = reinterpret_cast<const char *>(samples);
+    // runs too short for a frame of their own are gathered up first
+    if (npending > 0 || n < MIN_BLOCK) {
+        int c = n < MIN_BLOCK ? n : npending < MIN_BLOCK ? MIN_BLOCK - npending : 0;
+        if (c > MAX_BLOCK - npending) {
+            c = MAX_BLOCK - npending;
+        }
+        memcpy(pending+npending*bytes, buf, c*bytes);
+        npending += c;
+        buf += c*bytes;
+        n -= c;
+        if (n == 0 && npending < MAX_BLOCK) {
+            return;
+        }
+        drain();
+    }
+    while (n > 0) {
+        if (n < MIN_BLOCK) {
+            memcpy(pending, buf, n*bytes);
+            npending = n;
+            return;
+        }
+        int c = chunk(n);
+        frame(buf, c, true);
+        buf += c*bytes;
+        n -= c;
+    }
+}
+
+void PcmOutputFlac::silence(int n)
+{
+    if (npending > 0) {
+        int c = npending < MIN_BLOCK ? MIN_BLOCK - npending : 0;
+        if (c > n) {
+            c = n;
+        }
+        fill_silence(pending+npending*bytes, format, c);
+        npending += c;
+        n -= c;
+        if (npending < MIN_BLOCK) {
+            return;
+        }
+        drain();
+    }
+    while (n > 0) {
+        if (n < MIN_BLOCK) {
+            fill_silence(pending, format, n);
+            npending = n;
+            return;
+        }
+        int c = chunk(n);
+        constant(c);
+        n -= c;
+    }
+}
+
+// Samples still gathering for a frame stay where they are; a frame cut
+// short here would only cost space.
+void PcmOutputFlac::flush()
+{
+    fflush(f);
+}
+
+void PcmOutputFlac::drain()
+{
+    if (npending > 0) {
+        frame(pending, npending, false);
+        npending = 0;
+    }
+}
+
+void PcmOutputFlac::frame(const char *buf, int n, bool keep)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    Cached **slot = NULL;
+    if (keep) {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(buf);
+        for (int i = 0; i < n*bytes; i++) {
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+        }
+        slot = &cache[hash % CACHE_SIZE];
+        for (Cached *c = *slot; c != NULL; c = c->next) {
+            if (c->hash == hash && c->n == n && memcmp(c->samples, buf, n*bytes) == 0) {
+                writeFrame(c->data, c->size, n);
+                return;
+            }
+        }
+    }
+    bits->clear();
+    subframe(buf, n);
+    writeFrame(bits->data(), bits->length(), n);
+    if (keep && ncached < CACHE_SIZE) {
+        Cached *c = new Cached;
+        c->hash = hash;
+        c->n = n;
+        c->samples = new char[n*bytes];
+        memcpy(c->samples, buf, n*bytes);
+        c->size = bits->length();
+        c->data = new unsigned char[c->size];
+        memcpy(c->data, bits->data(), c->size);
+        c->next = *slot;
+        *slot = c;
+        ncached++;
+    }
+}
+
+void PcmOutputFlac::constant(int n)
+{
+    bits->clear();
+    bits->put(0, 8);
+    bits->put(0, bps);
+    bits->align();
+    writeFrame(bits->data(), bits->length(), n);
+}
+
+static unsigned zigzag(int r)
+{
+    return (static_cast<unsigned>(r) << 1) ^ static_cast<unsigned>(r >> 31);
+}
+
+// Approximate bits to Rice code count values adding up to sum, with the
+// parameter that gives the fewest.
+static unsigned long long rice_cost(unsigned long long sum, int count, int &k)
+{
+    unsigned long long best = ~0ULL;
+    for (int i = 0; i <= 14; i++) {
+        unsigned long long c = static_cast<unsigned long long>(count)*(i+1) + (sum >> i);
+        if (c < best) {
+            best = c;
+            k = i;
+        }
+    }
+    return best;
+}
+
+// Chooses how to partition the residual of a predictor of the given
+// order, and the Rice parameter of each partition, returning roughly
+// how many bits the residual will take.
+static unsigned long long partition(const int *res, int n, int order, int max_porder, int &porder, int *params)
+{
+    unsigned long long sums[64];
+    int parts = 1 << max_porder;
+    int m = n >> max_porder;
+    for (int i = 0; i < parts; i++) {
+        unsigned long long sum = 0;
+        for (int j = i == 0 ? order : i*m; j < (i+1)*m; j++) {
+            sum += zigzag(res[j]);
+        }
+        sums[i] = sum;
+    }
+    unsigned long long best = ~0ULL;
+    for (int p = max_porder; p >= 0; p--) {
+        int np = 1 << p;
+        int ks[64];
+        unsigned long long cost = 6;
+        for (int i = 0; i < np; i++) {
+            cost += 4 + rice_cost(sums[i], (n >> p) - (i == 0 ? order : 0), ks[i]);
+        }
+        if (cost < best) {
+            best = cost;
+            porder = p;
+            memcpy(params, ks, np*sizeof(int));
+        }
+        for (int i = 0; i < np/2; i++) {
+            sums[i] = sums[2*i] + sums[2*i+1];
+        }
+    }
+    return best;
+}
+
+// The largest partition order that divides n samples into partitions
+// each longer than the warm-up of a predictor of the given order.
+static int max_partition_order(int n, int order, int limit)
+{
+    int p = 0;
+    while (p < limit && n % (2 << p) == 0 && (n >> (p+1)) > order) {
+        p++;
+    }
+    return p;
+}
+
+// Linear prediction coefficients of orders 1 to maxorder for the given
+// autocorrelation, by the Levinson-Durbin recursion. coefs[o-1][j] is
+// the weight of the sample j+1 back in the predictor of order o. Returns
+// how many orders came out usable.
+static int levinson(const double *autoc, int maxorder, double coefs[][16])
+{
+    double c[16];
+    double err = autoc[0];
+    for (int i = 1; i <= maxorder; i++) {
+        if (err <= 0) {
+            return i-1;
+        }
+        double k = autoc[i];
+        for (int j = 1; j < i; j++) {
+            k -= c[j-1]*autoc[i-j];
+        }
+        k /= err;
+        double t[16];
+        for (int j = 1; j < i; j++) {
+            t[j-1] = c[j-1] - k*c[i-j-1];
+        }
+        memcpy(c, t, (i-1)*sizeof(double));
+        c[i-1] = k;
+        err *= 1 - k*k;
+        memcpy(coefs[i-1], c, i*sizeof(double));
+    }
+    return maxorder;
+}
+
+// Rounds coefficients to integers of the given precision scaled by 2 to
+// the power shift, carrying the rounding error from one to the next.
+// Returns false if they are too large to scale at all.
+static bool quantize(const double *c, int order, int precision, int *q, int &shift)
+{
+    double cmax = 0;
+    for (int j = 0; j < order; j++) {
+        if (fabs(c[j]) > cmax) {
+            cmax = fabs(c[j]);
+        }
+    }
+    if (cmax <= 0) {
+        return false;
+    }
+    int e;
+    frexp(cmax, &e);
+    shift = precision-1 - e;
+    if (shift < 0) {
+        return false;
+    }
+    if (shift > 15) {
+        shift = 15;
+    }
+    int qmax = (1 << (precision-1)) - 1;
+    double err = 0;
+    for (int j = 0; j < order; j++) {
+        err += c[j] * (1 << shift);
+        int v = static_cast<int>(floor(err + 0.5));
+        if (v > qmax) {
+            v = qmax;
+        } else if (v < -qmax-1) {
+            v = -qmax-1;
+        }
+        q[j] = v;
+        err -= v;
+    }
+    return true;
+}
+
+// Codes one channel of n samples into bits: CONSTANT if they are all the
+// same, otherwise whichever FIXED or LPC predictor comes out shortest, or
+// VERBATIM if none of them saves anything. A tone is predicted almost
+// exactly by an LPC of order two, which is where most of the saving is.
+void PcmOutputFlac::subframe(const char *buf, int n)
+{
+    int *x = residual[0];
+    if (format == FORMAT_U8) {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(buf);
+        for (int i = 0; i < n; i++) {
+            x[i] = p[i] - 128;
+        }
+    } else {
+        const short *p = reinterpret_cast<const short *>(buf);
+        for (int i = 0; i < n; i++) {
+            x[i] = p[i];
+        }
+    }
+    unsigned mask = (1U << bps) - 1;
+    bool same = true;
+    for (int i = 1; i < n && same; i++) {
+        same = x[i] == x[0];
+    }
+    if (same) {
+        bits->put(0, 8);
+        bits->put(x[0] & mask, bps);
+        bits->align();
+        return;
+    }
+    // the residual of each fixed order is the difference of the one before
+    int orders = n-1 < MAX_ORDER ? n-1 : MAX_ORDER;
+    for (int o = 1; o <= orders; o++) {
+        const int *r = residual[o-1];
+        int *d = residual[o];
+        for (int i = o; i < n; i++) {
+            d[i] = r[i] - r[i-1];
+        }
+    }
+    unsigned long long best = static_cast<unsigned long long>(n)*bps;
+    int order = -1;
+    bool lpc = false;
+    const int *res = NULL;
+    int porder = 0;
+    int params[64];
+    int p;
+    int ks[64];
+    for (int o = 0; o <= orders; o++) {
+        unsigned long long cost = o*bps + partition(residual[o], n, o, max_partition_order(n, o, MAX_PARTITION_ORDER), p, ks);
+        if (cost < best) {
+            best = cost;
+            order = o;
+            res = residual[o];
+            porder = p;
+            memcpy(params, ks, (1 << p)*sizeof(int));
+        }
+    }
+    int lpc_orders = n-1 < MAX_LPC_ORDER ? n-1 : MAX_LPC_ORDER;
+    double autoc[MAX_LPC_ORDER+1];
+    for (int lag = 0; lag <= lpc_orders; lag++) {
+        double sum = 0;
+        for (int i = lag; i < n; i++) {
+            sum += double(x[i]) * x[i-lag];
+        }
+        autoc[lag] = sum;
+    }
+    double coefs[MAX_LPC_ORDER][16];
+    lpc_orders = levinson(autoc, lpc_orders, coefs);
+    int qlp[MAX_LPC_ORDER];
+    int shift = 0;
+    int cur = 0;
+    for (int o = 1; o <= lpc_orders; o++) {
+        int q[MAX_LPC_ORDER];
+        int sh;
+        if (!quantize(coefs[o-1], o, LPC_PRECISION, q, sh)) {
+            continue;
+        }
+        int *r = lpc_residual[cur];
+        for (int i = o; i < n; i++) {
+            long long sum = 0;
+            for (int j = 0; j < o; j++) {
+                sum += static_cast<long long>(q[j]) * x[i-j-1];
+            }
+            r[i] = x[i] - static_cast<int>(sum >> sh);
+        }
+        unsigned long long cost = o*bps + 9 + o*LPC_PRECISION + partition(r, n, o, max_partition_order(n, o, MAX_PARTITION_ORDER), p, ks);
+        if (cost < best) {
+            best = cost;
+            order = o;
+            lpc = true;
+            res = r;
+            porder = p;
+            memcpy(params, ks, (1 << p)*sizeof(int));
+            memcpy(qlp, q, o*sizeof(int));
+            shift = sh;
+            cur ^= 1;
+        }
+    }
+    if (order < 0) {
+        bits->put(0x02, 8);
+        for (int i = 0; i < n; i++) {
+            bits->put(x[i] & mask, bps);
+        }
+        bits->align();
+        return;
+    }
+    bits->put(lpc ? (0x20 | (order-1)) << 1 : (0x08 | order) << 1, 8);
+    for (int i = 0; i < order; i++) {
+        bits->put(x[i] & mask, bps);
+    }
+    if (lpc) {
+        bits->put(LPC_PRECISION-1, 4);
+        bits->put(shift, 5);
+        for (int j = 0; j < order; j++) {
+            bits->put(qlp[j] & ((1U << LPC_PRECISION) - 1), LPC_PRECISION);
+        }
+    }
+    bits->put(0, 2);
+    bits->put(porder, 4);
+    int m = n >> porder;
+    for (int p = 0; p < (1 << porder); p++) {
+        int k = params[p];
+        bits->put(k, 4);
+        for (int i = p == 0 ? order : p*m; i < (p+1)*m; i++) {
+            unsigned u = zigzag(res[i]);
+            bits->zeros(u >> k);
+            bits->put((1U << k) | (u & ((1U << k) - 1)), k+1);
+        }
+    }
+    bits->align();
+}
+
+// Puts a frame header in front of a coded subframe. The frame carries
+// the number of its first sample, as frames with a variable block size
+// do, so that a cached subframe fits wherever it falls.
+void PcmOutputFlac::writeFrame(const unsigned char *sub, int size, int n)
+{
+    unsigned char h[16];
+    int len = 0;
+    h[len++] = 0xff;
+    h[len++] = 0xf9;
+    h[len++] = 0x70;
+    h[len++] = (bps == 8 ? 1 : 4) << 1;
+    // the sample number, coded as in UTF-8 but up to 36 bits
+    if (position < 0x80) {
+        h[len++] = static_cast<unsigned char>(position);
+    } else {
+        int extra = 1;
+        while (extra < 6 && position >> (5*extra + 6) != 0) {
+            extra++;
+        }
+        h[len++] = static_cast<unsigned char>(((0xff00 >> (extra+1)) & 0xff) | (position >> (6*extra)));
+        for (int i = extra-1; i >= 0; i--) {
+            h[len++] = static_cast<unsigned char>(0x80 | ((position >> (6*i)) & 0x3f));
+        }
+    }
+    h[len++] = static_cast<unsigned char>((n-1) >> 8);
+    h[len++] = static_cast<unsigned char>((n-1) & 0xff);
+    h[len] = static_cast<unsigned char>(crc8(h, len));
+    len++;
+    unsigned crc = crc16(sub, size, crc16(h, len, 0));
+    unsigned char footer[2] = {static_cast<unsigned char>(crc >> 8), static_cast<unsigned char>(crc & 0xff)};
+    fwrite(h, 1, len, f);
+    fwrite(sub, 1, size, f);
+    fwrite(footer, 1, 2, f);
+    int frame = len + size + 2;
+    if (min_frame == 0 || frame < min_frame) {
+        min_frame = frame;
+    }
+    if (frame > max_frame) {
+        max_frame = frame;
+    }
+    position += n;
+}
+
+#ifndef _WIN32
+
+PcmOutputMapped::PcmOutputMapped(const char *fn, int sample_rate, SampleFormat format)
+ : sample_rate(sample_rate), format(format), map(NULL), size(0), data(NULL), position(0)
+{
+    fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+}
+
+PcmOutputMapped::~PcmOutputMapped()
+{
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    close(fd);
+}
+
+void PcmOutputMapped::create(long long samples)
+{
+    unsigned long long data_size = samples*sample_size(format);
+    unsigned char header[PcmOutputWav::HEADER_MAX];
+    int header_size = PcmOutputWav::makeHeader(header, sample_rate, format, data_size, data_size > 0xffffffffULL - PcmOutputWav::HEADER_MAX);
+    size = header_size + data_size + (data_size & 1);
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+    map = reinterpret_cast<char *>(mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memcpy(map, header, header_size);
+    data = map + header_size;
+}
+
+void PcmOutputMapped::output(const void *buf, int n)
+{
+    memcpy(data+position*sample_size(format), buf, n*sample_size(format));
+    position += n;
+}
+
+void PcmOutputMapped::silence(int n)
+{
+    if (format == FORMAT_U8) {
+        fill_silence(data+position, format, n);
+    }
+    position += n;
+}
+
+#endif // _WIN32
+
+
+int open_stream(const char *fn)
+{
+    if (strcmp(fn, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fflush(stdout);
+        return dup(1);
+    }
+    return open(fn, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+}
+
+PcmOutputStream::PcmOutputStream(const char *fn, int sample_rate, SampleFormat format, bool header)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format)), splice(false), size(65536), current(0), index(0)
+{
+    fd = open_stream(fn);
+    if (fd < 0) {
+        perror(fn);
+        exit(1);
+    }
+    start(header);
+}
+
+PcmOutputStream::PcmOutputStream(int fd, int sample_rate, SampleFormat format, bool header)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format)), fd(fd), splice(false), size(65536), current(0), index(0)
+{
+    start(header);
+}
+
+void PcmOutputStream::start(bool header)
+{
+#if defined(__linux__) && defined(F_GETPIPE_SZ)
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    if (pipe_size > 0) {
+        splice = true;
+        size = pipe_size;
+    }
+#endif
+    mem = new char[BLOCKS*size+PAGE];
+    char *p = reinterpret_cast<char *>((reinterpret_cast<size_t>(mem) + PAGE-1) & ~static_cast<size_t>(PAGE-1));
+    for (int i = 0; i < BLOCKS; i++) {
+        blocks[i] = p + i*size;
+    }
+    if (header) {
+        unsigned char h[PcmOutputWav::HEADER_MAX];
+        write_all(fd, h, PcmOutputWav::makeHeader(h, sample_rate, format, ~0ULL, false));
+    }
+}
+
+PcmOutputStream::~PcmOutputStream()
+{
+    flush();
+    close(fd);
+    delete[] mem;
+}
+
+void PcmOutputStream::output(const void *samples, int n)
+{
+    const char *buf = reinterpret_cast<const char *>(samples);
+    size_t len = static_cast<size_t>(n)*bytes;
+    while (len > 0) {
+        size_t c = size - index;
+        if (c > len) {
+            c = len;
+        }
+        memcpy(blocks[current]+index, buf, c);
+        index += static_cast<int>(c);
+        buf += c;
+        len -= c;
+        if (index == size) {
+            send();
+        }
+    }
+}
+
+void PcmOutputStream::silence(int n)
+{
+    while (n > 0) {
+        int c = (size - index)/bytes;
+        if (c > n) {
+            c = n;
+        }
+        fill_silence(blocks[current]+index, format, c);
+        index += c*bytes;
+        n -= c;
+        if (index == size) {
+            send();
+        }
+    }
+}
+
+// A part block is copied into the pipe with write(), so that it can be
+// filled again straight away.
+void PcmOutputStream::flush()
+{
+    if (index > 0) {
+        write_all(fd, blocks[current], index);
+        index = 0;
+    }
+}
+
+void PcmOutputStream::send()
+{
+    char *p = blocks[current];
+    size_t len = size;
+#ifdef __linux__
+    while (splice && len > 0) {
+        struct iovec iov;
+        iov.iov_base = p;
+        iov.iov_len = len;
+        ssize_t r = vmsplice(fd, &iov, 1, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // not a pipe after all, or no vmsplice in this kernel
+            splice = false;
+            break;
+        }
+        p += r;
+        len -= r;
+    }
+#endif
+    write_all(fd, p, len);
+    current = (current + 1) % BLOCKS;
+    index = 0;
+}
+
+PcmOutputBuffered::PcmOutputBuffered(PcmOutput *out, int size)
+ : out(out), format(out->getSampleFormat()), bytes(sample_size(format)), size(size), index(0)
+{
+    if (this->size < 1) {
+        this->size = 1;
+    }
+    mem = new char[this->size*bytes+ALIGN];
+    buffer = reinterpret_cast<char *>((reinterpret_cast<size_t>(mem) + ALIGN-1) & ~static_cast<size_t>(ALIGN-1));
+}
+
+PcmOutputBuffered::~PcmOutputBuffered()
+{
+    flush();
+    delete out;
+    delete[] mem;
+}
+
+void PcmOutputBuffered::output(const void *samples, int n)
+{
+    const char *buf = reinterpret_cast<const char *>(samples);
+    while (n > 0) {
+        if (index == 0 && n >= size) {
+            out->output(buf, n);
+            return;
+        }
+        int c = size - index;
+        if (c > n) {
+            c = n;
+        }
+        memcpy(buffer+index*bytes, buf, c*bytes);
+        index += c;
+        buf += c*bytes;
+        n -= c;
+        if (index >= size) {
+            drain();
+        }
+    }
+}
+
+void PcmOutputBuffered::silence(int n)
+{
+    if (n <= size - index) {
+        fill_silence(buffer+index*bytes, format, n);
+        index += n;
+        if (index >= size) {
+            drain();
+        }
+    } else {
+        drain();
+        out->silence(n);
+    }
+}
+
+void PcmOutputBuffered::flush()
+{
+    drain();
+    out->flush();
+}
+
+// Whatever is still in the buffer has not reached the device yet, so it
+// can simply be dropped.
+void PcmOutputBuffered::reset()
+{
+    index = 0;
+    out->reset();
+}
+
+void PcmOutputBuffered::drain()
+{
+    if (index > 0) {
+        out->output(buffer, index);
+        index = 0;
+    }
+}
+
+
+PcmOutputMemory::PcmOutputMemory(int sample_rate, SampleFormat format)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format)), samples(NULL), nsamples(0), maxsamples(0), spans(NULL), nspans(0), maxspans(0)
+{
+}
+
+PcmOutputMemory::~PcmOutputMemory()
+{
+    delete[] samples;
+    delete[] spans;
+}
+
+void PcmOutputMemory::output(const void *buf, int n)
+{
+    if (nsamples + n > maxsamples) {
+        int size = maxsamples*2;
+        if (size < nsamples + n) {
+            size = nsamples + n;
+        }
+        char *s = new char[size*bytes];
+        if (nsamples > 0) {
+            memcpy(s, samples, nsamples*bytes);
+        }
+        delete[] samples;
+        samples = s;
+        maxsamples = size;
+    }
+    memcpy(samples+nsamples*bytes, buf, n*bytes);
+    add(n, nsamples);
+    nsamples += n;
+}
+
+void PcmOutputMemory::silence(int n)
+{
+    add(n, -1);
+}
+
+void PcmOutputMemory::add(int n, int offset)
+{
+    if (nspans > 0) {
+        Span &last = spans[nspans-1];
+        if (offset < 0 ? last.offset < 0 : last.offset >= 0 && last.offset+last.n == offset) {
+            last.n += n;
+            return;
+        }
+    }
+    if (nspans >= maxspans) {
+        int size = maxspans ? maxspans*2 : 64;
+        Span *s = new Span[size];
+        if (nspans > 0) {
+            memcpy(s, spans, nspans*sizeof(Span));
+        }
+        delete[] spans;
+        spans = s;
+        maxspans = size;
+    }
+    spans[nspans].n = n;
+    spans[nspans].offset = offset;
+    nspans++;
+}
+
+void PcmOutputMemory::replay(PcmOutput *out)
+{
+    for (int i = 0; i < nspans; i++) {
+        if (spans[i].offset < 0) {
+            out->silence(spans[i].n);
+        } else {
+            out->output(samples+spans[i].offset*bytes, spans[i].n);
+        }
+    }
+}
+
+void PcmOutputMemory::clear()
+{
+    nsamples = 0;
+    nspans = 0;
+}
+
+// The ring only needs each position to be read whole and in order with
+// the samples written before it.
+#ifdef _MSC_VER
+static long long load_acquire(long long *p) { return InterlockedOr64(p, 0); }
+static void store_release(long long *p, long long v) { InterlockedExchange64(p, v); }
+static int load_acquire(int *p) { return InterlockedOr(reinterpret_cast<long *>(p), 0); }
+static void store_release(int *p, int v) { InterlockedExchange(reinterpret_cast<long *>(p), v); }
+#else
+template <class T> static T load_acquire(T *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+template <class T> static void store_release(T *p, T v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+#endif
+
+PcmOutputRing::PcmOutputRing(PcmOutput *out, int period, int periods)
+ : out(out), sample_rate(out->getSampleRate()), format(out->getSampleFormat()), bytes(sample_size(format)),
+   period(period), periods(periods), head(0), tail(0), request(NONE), playing(false), start(0), played(0),
+   starved(false), dry(0), drained(0), seq(0), underruns(0), underrun_time(0), total_latency(0), latencies(0), max_latency(0)
+{
+    if (this->period < 1) {
+        this->period = 1;
+    }
+    if (this->periods < 2) {
+        this->periods = 2;
+    }
+    size = static_cast<long long>(this->period)*this->periods;
+    period_time = double(this->period)/sample_rate;
+    ring = new char[size*bytes];
+    stamps = new double[this->periods];
+    thread = new Thread(run, this);
+}
+
+PcmOutputRing::~PcmOutputRing()
+{
+    ask(QUIT);
+    thread->join();
+    delete thread;
+    delete out;
+    delete[] ring;
+    delete[] stamps;
+}
+
+double PcmOutputRing::getMeanLatency()
+{
+    long long n = load_acquire(&latencies);
+    return n > 0 ? load_acquire(&total_latency)*1e-6/n : 0;
+}
+
+double PcmOutputRing::getMaxLatency()
+{
+    return load_acquire(&max_latency)*1e-6;
+}
+
+int PcmOutputRing::getUnderruns()
+{
+    return load_acquire(&underruns);
+}
+
+double PcmOutputRing::getUnderrunTime()
+{
+    return load_acquire(&underrun_time)*1e-6;
+}
+
+void PcmOutputRing::output(const void *samples, int n)
+{
+    const char *buf = reinterpret_cast<const char *>(samples);
+    while (n > 0) {
+        long long room = size - (head - load_acquire(&tail));
+        if (room == 0) {
+            sleep_seconds(period_time/4);
+            continue;
+        }
+        long long c = room < n ? room : n;
+        double now = monotonic();
+        for (long long m = (head+period-1)/period*period; m < head+c; m += period) {
+            stamps[m/period % periods] = now;
+        }
+        long long i = head % size;
+        long long c1 = size-i < c ? size-i : c;
+        memcpy(ring+i*bytes, buf, c1*bytes);
+        memcpy(ring, buf+c1*bytes, (c-c1)*bytes);
+        store_release(&head, head+c);
+        buf += c*bytes;
+        n -= static_cast<int>(c);
+    }
+}
+
+void PcmOutputRing::flush()
+{
+    ask(FLUSH);
+}
+
+int PcmOutputRing::getDelay()
+{
+    for (;;) {
+        int s = load_acquire(&seq);
+        long long t = load_acquire(&tail);
+        long long d = load_acquire(&drained);
+        if (s % 2 == 0 && load_acquire(&seq) == s) {
+            double left = d*1e-6 - monotonic();
+            return static_cast<int>(head - t) + (left > 0 ? static_cast<int>(left*sample_rate) : 0);
+        }
+    }
+}
+
+void PcmOutputRing::reset()
+{
+    ask(RESET);
+}
+
+// Hands a request to the thread and waits for it to be carried out.
+void PcmOutputRing::ask(int r)
+{
+    store_release(&request, r);
+    while (load_acquire(&request) != NONE) {
+        sleep_seconds(period_time/4);
+    }
+}
+
+void PcmOutputRing::run(void *arg)
+{
+    reinterpret_cast<PcmOutputRing *>(arg)->consume();
+}
+
+void PcmOutputRing::consume()
+{
+    for (;;) {
+        int r = load_acquire(&request);
+        if (r == RESET) {
+            store_release(&tail, load_acquire(&head));
+            out->reset();
+            playing = false;
+            starved = false;
+            store_release(&request, static_cast<int>(NONE));
+            continue;
+        }
+        long long avail = load_acquire(&head) - tail;
+        double now = monotonic();
+        // time left before the device has played all it has been given
+        double left = start + double(played)/sample_rate - now;
+        if (playing && left < 0 && r == NONE) {
+            store_release(&underruns, underruns+1);
+            playing = false;
+            starved = true;
+            dry = now + left;
+        }
+        // less than a period is only sent if it is all there is going
+        // to be, or if the device would run dry waiting for the rest
+        if (avail >= period || (avail > 0 && (r != NONE || (playing && left < period_time)))) {
+            long long n = avail < period ? avail : period;
+            if (!playing) {
+                playing = true;
+                start = now;
+                played = 0;
+                if (starved) {
+                    store_release(&underrun_time, underrun_time + static_cast<long long>((now - dry)*1e6));
+                    starved = false;
+                }
+            }
+            double delay = double(out->getDelay())/sample_rate;
+            for (long long m = (tail+period-1)/period*period; m < tail+n; m += period) {
+                long long latency = static_cast<long long>((now - stamps[m/period % periods] + delay)*1e6);
+                store_release(&total_latency, total_latency + latency);
+                store_release(&latencies, latencies + 1);
+                if (latency > max_latency) {
+                    store_release(&max_latency, latency);
+                }
+            }
+            long long i = tail % size;
+            long long c = size-i < n ? size-i : n;
+            out->output(ring+i*bytes, static_cast<int>(c));
+            if (c < n) {
+                out->output(ring, static_cast<int>(n-c));
+            }
+            played += n;
+            long long when = static_cast<long long>((monotonic() + double(out->getDelay())/sample_rate)*1e6);
+            store_release(&seq, seq+1);
+            store_release(&tail, tail+n);
+            store_release(&drained, when);
+            store_release(&seq, seq+1);
+            continue;
+        }
+        if (r == FLUSH || r == QUIT) {
+            out->flush();
+            playing = false;
+            starved = false;
+            store_release(&request, static_cast<int>(NONE));
+            if (r == QUIT) {
+                return;
+            }
+            continue;
+        }
+        sleep_seconds(period_time/4);
+    }
+}
+
+#ifdef _WIN32
+
+class PcmOutputWin32: public PcmOutput {
+public:
+    PcmOutputWin32(int sample_rate, SampleFormat format);
+    virtual ~PcmOutputWin32();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void flush();
+    virtual void reset();
+private:
+    int sample_rate;
+    SampleFormat format;
+    int bytes;
+    HWAVEOUT wo;
+    struct Buffer {
+        bool prepared;
+        WAVEHDR hdr;
+        enum {SIZE = 16384};
+        char data[SIZE*4];
+        int index;
+    };
+    enum {NBUFS = 4};
+    Buffer buffers[NBUFS];
+    int bufindex;
+    int buftail;
+    void wait();
+};
+
+PcmOutputWin32::PcmOutputWin32(int sample_rate, SampleFormat format)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format))
+{
+    WAVEFORMATEX wf;
+    wf.wFormatTag = format == FORMAT_F32 ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    wf.nChannels = 1;
+    wf.nSamplesPerSec = sample_rate;
+    wf.nAvgBytesPerSec = sample_rate*bytes*1;
+    wf.nBlockAlign = bytes;
+    wf.wBitsPerSample = bytes*8;
+    wf.cbSize = 0;
+    MMRESULT r = waveOutOpen(&wo, WAVE_MAPPER, &wf, 0, 0, CALLBACK_NULL);
+    if (r != MMSYSERR_NOERROR) {
+        fprintf(stderr, "could not open wave device\n");
+        exit(1);
+    }
+    for (int i = 0; i < NBUFS; i++) {
+        buffers[i].prepared = false;
+        buffers[i].hdr.lpData = (char *)buffers[i].data;
+        buffers[i].hdr.dwBufferLength = Buffer::SIZE*bytes;
+        buffers[i].hdr.dwFlags = 0;
+        buffers[i].index = 0;
+    }
+    bufindex = 0;
+    buftail = 0;
+}
+
+PcmOutputWin32::~PcmOutputWin32()
+{
+    flush();
+    waveOutReset(wo);
+    waveOutClose(wo);
+}
+
+void PcmOutputWin32::output(const void *samples, int n)
+{
+    const char *buf = reinterpret_cast<const char *>(samples);
+    while (n > 0) {
+        if (!buffers[bufindex].prepared) {
+            buffers[bufindex].hdr.dwBufferLength = Buffer::SIZE*bytes;
+            buffers[bufindex].hdr.dwFlags = 0;
+            MMRESULT r = waveOutPrepareHeader(wo, &buffers[bufindex].hdr, sizeof(WAVEHDR));
+            if (r != MMSYSERR_NOERROR) {
+                fprintf(stderr, "error preparing header\n");
+                return;
+            }
+            buffers[bufindex].index = 0;
+            buffers[bufindex].prepared = true;
+        }
+        int c = Buffer::SIZE-buffers[bufindex].index;
+        if (c > n) {
+            c = n;
+        }
+        memcpy(buffers[bufindex].data+buffers[bufindex].index*bytes, buf, c*bytes);
+        buffers[bufindex].index += c;
+        buf += c*bytes;
+        n -= c;
+        if (buffers[bufindex].index >= Buffer::SIZE) {
+            MMRESULT r = waveOutWrite(wo, &buffers[bufindex].hdr, sizeof(WAVEHDR));
+            if (r != MMSYSERR_NOERROR) {
+                fprintf(stderr, "error on waveOutWrite: %d\n", r);
+                return;
+            }
+            int newbufindex = (bufindex + 1) % NBUFS;
+            if (newbufindex == buftail) {
+                wait();
+            }
+            bufindex = newbufindex;
+            assert(bufindex != buftail);
+        }
+    }
+}
+
+void PcmOutputWin32::flush()
+{
+    if (buffers[bufindex].prepared && buffers[bufindex].index > 0) {
+        buffers[bufindex].hdr.dwBufferLength = buffers[bufindex].index*bytes;
+        MMRESULT r = waveOutWrite(wo, &buffers[bufindex].hdr, sizeof(WAVEHDR));
+        if (r != MMSYSERR_NOERROR) {
+            fprintf(stderr, "error on waveOutWrite: %d\n", r);
+            return;
+        }
+        int newbufindex = (bufindex + 1) % NBUFS;
+        if (newbufindex == buftail) {
+            wait();
+        }
+        bufindex = newbufindex;
+        assert(bufindex != buftail);
+    }
+    while (buftail != bufindex) {
+        wait();
+    }
+}
+
+// waveOutReset() marks every queued buffer done at once, so they can all
+// be taken back straight away.
+void PcmOutputWin32::reset()
+{
+    waveOutReset(wo);
+    while (buftail != bufindex) {
+        wait();
+    }
+    buffers[bufindex].index = 0;
+}
+
+void PcmOutputWin32::wait()
+{
+    if (buftail == bufindex) {
+        return;
+    }
+    while ((buffers[buftail].hdr.dwFlags & WHDR_DONE) == 0) {
+        Sleep(100);
+    }
+    MMRESULT r = waveOutUnprepareHeader(wo, &buffers[buftail].hdr, sizeof(WAVEHDR));
+    if (r != MMSYSERR_NOERROR) {
+        fprintf(stderr, "error on waveOutUnprepareHeader: %d\n", r);
+        return;
+    }
+    buffers[buftail].prepared = false;
+    buftail = (buftail + 1) % NBUFS;
+}
+
+#endif // _WIN32
+
+#ifdef __APPLE__
+
+class PcmOutputMacOSX: public PcmOutput {
+public:
+    PcmOutputMacOSX(int sample_rate, SampleFormat format);
+    virtual ~PcmOutputMacOSX();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void flush();
+    virtual void reset();
+private:
+    enum {
+        NBUFFERS = 3,
+        BUFFER_SIZE = 4096
+    };
+    int sample_rate;
+    SampleFormat format;
+    int bytes;
+    char buffer[BUFFER_SIZE*4];
+    int index;
+    AudioQueueRef aq;
+    AudioQueueBufferRef buffers[NBUFFERS];
+    sem_t *sem_notfull;
+    sem_t *sem_full;
+    static void callback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer);
+};
+
+PcmOutputMacOSX::PcmOutputMacOSX(int sample_rate, SampleFormat format)
+ : sample_rate(sample_rate), format(format), bytes(sample_size(format)), index(0), aq(NULL)
+{
+    sem_unlink("com.hewgill.morse.notfull");
+    sem_unlink("com.hewgill.morse.full");
+    sem_notfull = sem_open("com.hewgill.morse.notfull", O_CREAT|O_EXCL, 0700, 1);
+    if (sem_notfull == SEM_FAILED) {
+        perror("sem_open");
+        exit(1);
+    }
+    sem_full = sem_open("com.hewgill.morse.full", O_CREAT|O_EXCL, 0700, 0);
+    if (sem_full == SEM_FAILED) {
+        perror("sem_open");
+        exit(1);
+    }
+
+    AudioStreamBasicDescription desc;
+    desc.mSampleRate = sample_rate;
+    desc.mFormatID = kAudioFormatLinearPCM;
+    switch (format) {
+    case FORMAT_U8:
+        desc.mFormatFlags = kLinearPCMFormatFlagIsPacked;
+        break;
+    case FORMAT_S16:
+        desc.mFormatFlags = kLinearPCMFormatFlagIsSignedInteger | kLinearPCMFormatFlagIsPacked;
+        break;
+    case FORMAT_F32:
+        desc.mFormatFlags = kLinearPCMFormatFlagIsFloat | kLinearPCMFormatFlagIsPacked;
+        break;
+    }
+    desc.mBytesPerPacket = bytes;
+    desc.mFramesPerPacket = 1;
+    desc.mBytesPerFrame = bytes;
+    desc.mChannelsPerFrame = 1;
+    desc.mBitsPerChannel = bytes*8;
+    desc.mReserved = 0;
+    OSStatus status = AudioQueueNewOutput(&desc, callback, this, NULL, NULL, 0, &aq);
+    if (status != 0) {
+        fprintf(stderr, "could not open output audio queue: %d\n", status);
+        exit(1);
+    }
+    for (int i = 0; i < NBUFFERS; i++) {
+        status = AudioQueueAllocateBuffer(aq, BUFFER_SIZE*bytes, &buffers[i]);
+        if (status != 0) {
+            fprintf(stderr, "could not allocate audio buffer: %d\n", status);
+            exit(1);
+        }
+        buffers[i]->mAudioDataByteSize = BUFFER_SIZE * bytes;
+        fill_silence(buffers[i]->mAudioData, format, BUFFER_SIZE);
+        AudioQueueEnqueueBuffer(aq, buffers[i], 0, NULL);
+    }
+    status = AudioQueueStart(aq, NULL);
+    if (status != 0) {
+        fprintf(stderr, "could not start output audio queue: %d\n", status);
+        exit(1);
+    }
+}
+
+PcmOutputMacOSX::~PcmOutputMacOSX()
+{
+    //printf("destructor index=%d\n", index);
+    sem_wait(sem_notfull);
+    sem_post(sem_full);
+    sem_wait(sem_notfull);
+    if (aq != NULL) {
+        AudioQueueDispose(aq, false);
+    }
+    sem_close(sem_notfull);
+    sem_close(sem_full);
+}
+
+void PcmOutputMacOSX::output(const void *samples, int n)
+{
+    const char *buf = reinterpret_cast<const char *>(samples);
+    while (n > 0) {
+        //printf("output %d index=%d\n", n, index);
+        sem_wait(sem_notfull);
+        int take = BUFFER_SIZE - index;
+        if (n < take) {
+            take = n;
+        }
+        memcpy(buffer + index*bytes, buf, take * bytes);
+        index += take;
+        buf += take*bytes;
+        n -= take;
+        if (index < BUFFER_SIZE) {
+            sem_post(sem_notfull);
+        } else {
+            sem_post(sem_full);
+        }
+    }
+}
+
+void PcmOutputMacOSX::flush()
+{
+}
+
+// Only the buffer being filled can be dropped; the ones already handed to
+// the queue, a fraction of a second between them, still play out.
+void PcmOutputMacOSX::reset()
+{
+    sem_wait(sem_notfull);
+    index = 0;
+    sem_post(sem_notfull);
+}
+
+void PcmOutputMacOSX::callback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
+{
+    //printf("callback %p\n", inBuffer);
+    PcmOutputMacOSX *This = reinterpret_cast<PcmOutputMacOSX *>(inUserData);
+    sem_wait(This->sem_full);
+    //printf("  index=%d\n", This->index);
+    inBuffer->mAudioDataByteSize = This->index * This->bytes;
+    memcpy(inBuffer->mAudioData, This->buffer, inBuffer->mAudioDataByteSize);
+    AudioQueueEnqueueBuffer(This->aq, inBuffer, 0, NULL);
+    if (This->index < BUFFER_SIZE) {
+        //printf("stop\n");
+        AudioQueueStop(This->aq, false);
+    }
+    This->index = 0;
+    sem_post(This->sem_notfull);
+}
+
+#endif // __APPLE__
+
+PcmOutput *open_device(const char *name, int sample_rate, SampleFormat format)
+{
+#ifdef _WIN32
+    if (name != NULL) {
+        fprintf(stderr, "cannot open device %s, only the default one\n", name);
+        exit(1);
+    }
+    return new PcmOutputWin32(sample_rate, format);
+#else
+    // only a name that was asked for is created as a file
+    int flags = O_WRONLY|O_CREAT|O_TRUNC;
+#if defined(unix)
+    if (name == NULL) {
+        name = "/dev/dsp";
+        flags = O_WRONLY;
+    }
+#elif defined(__APPLE__)
+    if (name == NULL) {
+        return new PcmOutputMacOSX(sample_rate, format);
+    }
+#else
+    #error unsupported platform
+#endif
+    int fd = strcmp(name, "-") == 0 ? dup(1) : open(name, flags, 0666);
+    if (fd < 0) {
+        perror(name);
+        exit(1);
+    }
+#ifdef unix
+    int formats;
+    if (ioctl(fd, SNDCTL_DSP_GETFMTS, &formats) == 0) {
+        return new PcmOutputUnix(fd, sample_rate, format);
+    }
+#endif
+    return new PcmOutputPaced(fd, sample_rate, format);
+#endif
+}
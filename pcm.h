@@ -0,0 +1,324 @@
+#ifndef PCM_H
+#define PCM_H
+
+#include <stdio.h>
+
+class Thread;
+
+// Sample formats an output can be asked for. As in WAV files, 8 bit
+// samples are unsigned, so their silence is 0x80 rather than zero.
+enum SampleFormat {
+    FORMAT_U8,
+    FORMAT_S16,
+    FORMAT_F32
+};
+
+int sample_size(SampleFormat format);
+void fill_silence(void *buf, SampleFormat format, int n);
+
+// An output is created with the sample rate and format the caller would
+// like; getSampleRate() and getSampleFormat() report what it actually
+// settled on, and output() takes samples in that format. reset() throws
+// away whatever has been output but not yet played, where that is
+// possible, so that playback can be stopped quickly. getDelay() tells how
+// many of the samples output are still waiting to be played, for outputs
+// that know.
+class PcmOutput {
+public:
+    virtual ~PcmOutput() {}
+    virtual int getSampleRate() = 0;
+    virtual SampleFormat getSampleFormat() = 0;
+    virtual void output(const void *buf, int n) = 0;
+    virtual void silence(int n);
+    virtual void flush() {}
+    virtual void reset() {}
+    virtual int getDelay() { return 0; }
+};
+
+// Throws the samples away, for timing everything that comes before.
+class PcmOutputNull: public PcmOutput {
+public:
+    PcmOutputNull(int sample_rate, SampleFormat format) : sample_rate(sample_rate), format(format) {}
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *, int) {}
+    virtual void silence(int) {}
+private:
+    int sample_rate;
+    SampleFormat format;
+};
+
+// Writes a WAV file. The header is written with explicit little endian
+// fields and patched with the final sizes when the file is closed. With
+// rf64, room is left for the ds64 chunk of an RF64 file, which is filled
+// in if the data turns out not to fit in 4GB.
+class PcmOutputWav: public PcmOutput {
+public:
+    PcmOutputWav(const char *fn, int sample_rate, SampleFormat format, bool rf64);
+    PcmOutputWav(FILE *f, int sample_rate, SampleFormat format, bool rf64);
+    virtual ~PcmOutputWav();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    virtual void flush();
+    enum {HEADER_MAX = 96};
+    static int makeHeader(unsigned char *buf, int sample_rate, SampleFormat format, unsigned long long data_size, bool rf64);
+private:
+    int sample_rate;
+    SampleFormat format;
+    bool rf64;
+    bool seekable;
+    unsigned long long data_size;
+    long long pending;
+    FILE *f;
+    void start();
+    void skip();
+};
+
+// Writes a FLAC file, or a FLAC stream to stdout for "-". The samples of
+// each output() call are coded as frames of their own (the block size is
+// variable), so a sound that is output again, as every character is,
+// comes out as the same frames again; the subframes of those are cached
+// and reused without coding the samples a second time. Silence takes a
+// CONSTANT subframe of a few bytes per frame, and a tone is coded as the
+// small error of a linear predictor. FLAC has no float samples, so only
+// 8 and 16 bit ones can be written.
+class PcmOutputFlac: public PcmOutput {
+public:
+    PcmOutputFlac(const char *fn, int sample_rate, SampleFormat format);
+    PcmOutputFlac(FILE *f, int sample_rate, SampleFormat format);
+    virtual ~PcmOutputFlac();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    virtual void flush();
+private:
+    enum {MIN_BLOCK = 16, MAX_BLOCK = 4608, MAX_ORDER = 4, MAX_LPC_ORDER = 8, LPC_PRECISION = 15, MAX_PARTITION_ORDER = 6, CACHE_SIZE = 1024};
+    class Bits;
+    struct Cached {
+        unsigned long long hash;
+        int n;
+        char *samples;
+        unsigned char *data;
+        int size;
+        Cached *next;
+    };
+    int sample_rate;
+    SampleFormat format;
+    int bytes;
+    int bps;
+    FILE *f;
+    bool seekable;
+    unsigned long long position;
+    int min_frame;
+    int max_frame;
+    char *pending;
+    int npending;
+    int *residual[MAX_ORDER+1];
+    int *lpc_residual[2];
+    Bits *bits;
+    Cached *cache[CACHE_SIZE];
+    int ncached;
+    void start();
+    void writeHeader();
+    void drain();
+    void frame(const char *buf, int n, bool keep);
+    void constant(int n);
+    void subframe(const char *buf, int n);
+    void writeFrame(const unsigned char *sub, int size, int n);
+    static int chunk(int n);
+};
+
+#ifndef _WIN32
+
+// Renders straight into a WAV file mapped into memory. The total number
+// of samples must be known before anything is output, so that the file
+// can be created at its final size; silence then costs nothing at all
+// since the new file already reads back as zeros.
+class PcmOutputMapped: public PcmOutput {
+public:
+    PcmOutputMapped(const char *fn, int sample_rate, SampleFormat format);
+    virtual ~PcmOutputMapped();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    void create(long long samples);
+private:
+    int sample_rate;
+    SampleFormat format;
+    int fd;
+    char *map;
+    size_t size;
+    char *data;
+    long long position;
+};
+
+#endif // _WIN32
+
+// Streams samples into a pipe, or to stdout for "-", as they are made:
+// raw, or after a WAV header whose sizes mean "until the end of the
+// stream". They are gathered into page aligned blocks as large as the
+// pipe, and on Linux each full block is handed over with vmsplice(),
+// which gives the pipe the pages themselves rather than a copy. The pipe
+// may go on reading a block after that returns, so the blocks are used
+// in turn; by the time one comes round again, a whole pipe's worth has
+// been handed over since, so the pipe must have been read past it.
+class PcmOutputStream: public PcmOutput {
+public:
+    PcmOutputStream(const char *fn, int sample_rate, SampleFormat format, bool header);
+    PcmOutputStream(int fd, int sample_rate, SampleFormat format, bool header);
+    virtual ~PcmOutputStream();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    virtual void flush();
+private:
+    enum {BLOCKS = 3, PAGE = 4096};
+    int sample_rate;
+    SampleFormat format;
+    int bytes;
+    int fd;
+    bool splice;
+    int size;
+    char *mem;
+    char *blocks[BLOCKS];
+    int current;
+    int index;
+    void start(bool header);
+    void send();
+};
+
+// Opens fn for a PcmOutputStream, or stdout for "-", and returns the file
+// descriptor, or -1 if it cannot be opened.
+int open_stream(const char *fn);
+
+// Collects the samples from many small output() calls into one aligned
+// block and hands them on to another PcmOutput in large chunks. No more
+// than size samples are ever held back, which bounds the latency added
+// in front of a live device.
+class PcmOutputBuffered: public PcmOutput {
+public:
+    PcmOutputBuffered(PcmOutput *out, int size);
+    virtual ~PcmOutputBuffered();
+    virtual int getSampleRate() { return out->getSampleRate(); }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    virtual void flush();
+    virtual void reset();
+private:
+    enum {ALIGN = 64};
+    PcmOutput *out;
+    SampleFormat format;
+    int bytes;
+    char *mem;
+    char *buffer;
+    int size;
+    int index;
+    void drain();
+};
+
+// Records output in memory so that it can be replayed into another
+// PcmOutput later. Runs of silence are kept as counts, not samples.
+class PcmOutputMemory: public PcmOutput {
+public:
+    PcmOutputMemory(int sample_rate, SampleFormat format);
+    virtual ~PcmOutputMemory();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    void replay(PcmOutput *out);
+    void clear();
+private:
+    struct Span {
+        int n;
+        int offset; // -1 for silence
+    };
+    int sample_rate;
+    SampleFormat format;
+    int bytes;
+    char *samples;
+    int nsamples;
+    int maxsamples;
+    Span *spans;
+    int nspans;
+    int maxspans;
+    void add(int n, int offset);
+};
+
+// Keeps a sound device fed from a thread of its own, so that whoever
+// generates the samples never blocks on the device. Samples are put into
+// a ring holding periods periods of period samples, which is all the
+// latency it can add, and the thread passes them on a period at a time.
+// There is one writer and one reader, and each side only ever moves its
+// own position in the ring, so neither takes a lock. An underrun is
+// counted when the device must have run dry while more was on its way.
+class PcmOutputRing: public PcmOutput {
+public:
+    PcmOutputRing(PcmOutput *out, int period, int periods);
+    virtual ~PcmOutputRing();
+    virtual int getSampleRate() { return sample_rate; }
+    virtual SampleFormat getSampleFormat() { return format; }
+    virtual void output(const void *buf, int n);
+    virtual void flush();
+    virtual void reset();
+    // What is in the ring and what the device still has to play, which
+    // may be asked from the thread that outputs.
+    virtual int getDelay();
+    // Seconds from a sample going into the ring to it being played,
+    // measured at the start of each period. These may be read while
+    // playing, from any thread.
+    double getMeanLatency();
+    double getMaxLatency();
+    int getUnderruns();
+    // Seconds the device spent with nothing to play, over all underruns.
+    double getUnderrunTime();
+private:
+    enum {NONE, FLUSH, RESET, QUIT};
+    PcmOutput *out;
+    int sample_rate;
+    SampleFormat format;
+    int bytes;
+    int period;
+    int periods;
+    long long size;
+    double period_time;
+    char *ring;
+    double *stamps;
+    long long head;
+    long long tail;
+    int request;
+    Thread *thread;
+    bool playing;
+    double start;
+    long long played;
+    bool starved;
+    double dry;
+    // when the device will have played all it has been given, in
+    // microseconds, published along with tail under the count seq, which
+    // is odd while the two are being changed
+    long long drained;
+    int seq;
+    // statistics, in microseconds
+    int underruns;
+    long long underrun_time;
+    long long total_latency;
+    long long latencies;
+    long long max_latency;
+    void ask(int r);
+    void consume();
+    static void run(void *arg);
+};
+
+// Opens a sound device, asking for the given rate and format. With no
+// name, that is the usual device of the platform. A name that is not a
+// sound device is opened as a file or pipe that is written to no faster
+// than the samples would play, which stands in for a device in tests.
+PcmOutput *open_device(const char *name, int sample_rate, SampleFormat format);
+
+#endif
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "player.h"
+
+#ifdef _WIN32
+#define for if(0);else for
+#endif
+
+Player::Player(PcmOutput *out)
+ : out(out), gate(this), synth(NULL), text(NULL), thread(NULL), stopping(false)
+{
+    // blocks of 10ms
+    block = out->getSampleRate()/100;
+    if (block < 1) {
+        block = 1;
+    }
+}
+
+Player::~Player()
+{
+    stop();
+    delete out;
+}
+
+void Player::play(Synth *synth, const char *text)
+{
+    stop();
+    this->synth = synth;
+    this->text = new char[strlen(text)+1];
+    strcpy(this->text, text);
+    mutex.lock();
+    stopping = false;
+    mutex.unlock();
+    thread = new Thread(run, this);
+}
+
+void Player::stop()
+{
+    mutex.lock();
+    stopping = true;
+    mutex.unlock();
+    wait();
+}
+
+// Waits for the text to finish playing.
+void Player::wait()
+{
+    if (thread == NULL) {
+        return;
+    }
+    thread->join();
+    delete thread;
+    thread = NULL;
+    delete[] text;
+    text = NULL;
+}
+
+bool Player::stopped()
+{
+    mutex.lock();
+    bool r = stopping;
+    mutex.unlock();
+    return r;
+}
+
+void Player::run(void *arg)
+{
+    Player *This = reinterpret_cast<Player *>(arg);
+    long long carry = 0;
+    This->synth->send(&This->gate, This->text, strlen(This->text), &carry);
+    This->synth->send(&This->gate, " ", 1, &carry);
+    if (This->stopped()) {
+        This->out->reset();
+    } else {
+        This->out->flush();
+    }
+}
+
+void Player::Gate::output(const void *buf, int n)
+{
+    const char *p = reinterpret_cast<const char *>(buf);
+    int bytes = sample_size(getSampleFormat());
+    while (n > 0 && !player->stopped()) {
+        int c = n < player->block ? n : player->block;
+        player->out->output(p, c);
+        p += c*bytes;
+        n -= c;
+    }
+}
+
+void Player::Gate::silence(int n)
+{
+    while (n > 0 && !player->stopped()) {
+        int c = n < player->block ? n : player->block;
+        player->out->silence(c);
+        n -= c;
+    }
+}
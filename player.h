@@ -0,0 +1,46 @@
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include "pcm.h"
+#include "synth.h"
+#include "thread.h"
+
+// Plays text on an output from a background thread, so that the caller
+// can get on with other things and stop it at any moment. The output is
+// kept open from one play() to the next. Samples are passed on in short
+// blocks with a check for stop() between them, and once stopped the
+// output is reset, so stopping takes about one block plus the time the
+// device needs to throw away what it has queued.
+class Player {
+public:
+    Player(PcmOutput *out);
+    ~Player();
+    int getSampleRate() { return out->getSampleRate(); }
+    SampleFormat getSampleFormat() { return out->getSampleFormat(); }
+    void play(Synth *synth, const char *text);
+    void stop();
+    void wait();
+private:
+    class Gate: public PcmOutput {
+    public:
+        Gate(Player *player) : player(player) {}
+        virtual int getSampleRate() { return player->out->getSampleRate(); }
+        virtual SampleFormat getSampleFormat() { return player->out->getSampleFormat(); }
+        virtual void output(const void *buf, int n);
+        virtual void silence(int n);
+    private:
+        Player *player;
+    };
+    PcmOutput *out;
+    Gate gate;
+    int block;
+    Synth *synth;
+    char *text;
+    Thread *thread;
+    bool stopping;
+    Mutex mutex;
+    bool stopped();
+    static void run(void *arg);
+};
+
+#endif
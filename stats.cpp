@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#define for if(0);else for
+#endif
+
+Stats::Stats()
+ : started(monotonic()), setup(0), chars(0), send(0), samples(0), silence(0), calls(0), output(0), wait(0), ring(NULL)
+{
+    memset(sizes, 0, sizeof(sizes));
+}
+
+void Stats::line(FILE *f)
+{
+    fprintf(f, "stats: %.1fs chars %lld samples %lld (%.0f%% silence) calls %lld (%.0f avg) setup %.1fms send %.1fms output %.1fms wait %.1fms",
+        monotonic() - started,
+        chars,
+        samples,
+        samples > 0 ? 100.0*silence/samples : 0.0,
+        calls,
+        calls > 0 ? double(samples - silence)/calls : 0.0,
+        setup*1000,
+        send*1000,
+        output*1000,
+        wait*1000);
+    if (ring != NULL) {
+        fprintf(f, " latency %.1fms/%.1fms underruns %d (%.1fms)",
+            ring->getMeanLatency()*1000,
+            ring->getMaxLatency()*1000,
+            ring->getUnderruns(),
+            ring->getUnderrunTime()*1000);
+    }
+    fprintf(f, "\n");
+}
+
+void Stats::json(FILE *f)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"elapsed_seconds\": %.6f,\n", monotonic() - started);
+    fprintf(f, "  \"setup_seconds\": %.6f,\n", setup);
+    fprintf(f, "  \"chars\": %lld,\n", chars);
+    fprintf(f, "  \"send_seconds\": %.6f,\n", send);
+    fprintf(f, "  \"output_seconds\": %.6f,\n", output);
+    fprintf(f, "  \"wait_seconds\": %.6f,\n", wait);
+    fprintf(f, "  \"samples\": %lld,\n", samples);
+    fprintf(f, "  \"silence_samples\": %lld,\n", silence);
+    fprintf(f, "  \"output_calls\": %lld,\n", calls);
+    fprintf(f, "  \"output_sizes\": {");
+    bool first = true;
+    for (int i = 0; i < SIZES; i++) {
+        if (sizes[i] > 0) {
+            fprintf(f, "%s\"%d\": %lld", first ? "" : ", ", 1 << i, sizes[i]);
+            first = false;
+        }
+    }
+    fprintf(f, "}");
+    if (ring != NULL) {
+        fprintf(f, ",\n  \"device\": {\n");
+        fprintf(f, "    \"latency_mean_seconds\": %.6f,\n", ring->getMeanLatency());
+        fprintf(f, "    \"latency_max_seconds\": %.6f,\n", ring->getMaxLatency());
+        fprintf(f, "    \"underruns\": %d,\n", ring->getUnderruns());
+        fprintf(f, "    \"underrun_seconds\": %.6f\n", ring->getUnderrunTime());
+        fprintf(f, "  }");
+    }
+    fprintf(f, "\n}\n");
+}
+
+PcmOutputStats::PcmOutputStats(PcmOutput *out, Stats *stats, double interval)
+ : out(out), stats(stats), interval(interval), next(monotonic() + interval)
+{
+}
+
+PcmOutputStats::~PcmOutputStats()
+{
+    delete out;
+}
+
+void PcmOutputStats::output(const void *buf, int n)
+{
+    double start = monotonic();
+    out->output(buf, n);
+    double now = monotonic();
+    stats->output += now - start;
+    stats->samples += n;
+    stats->calls++;
+    int i = 0;
+    while (i < Stats::SIZES-1 && (n >> (i+1)) != 0) {
+        i++;
+    }
+    stats->sizes[i]++;
+    tick(now);
+}
+
+void PcmOutputStats::silence(int n)
+{
+    double start = monotonic();
+    out->silence(n);
+    double now = monotonic();
+    stats->output += now - start;
+    stats->samples += n;
+    stats->silence += n;
+    tick(now);
+}
+
+void PcmOutputStats::flush()
+{
+    double start = monotonic();
+    out->flush();
+    double now = monotonic();
+    stats->wait += now - start;
+    tick(now);
+}
+
+void PcmOutputStats::tick(double now)
+{
+    if (interval > 0 && now >= next) {
+        stats->line(stderr);
+        next = now + interval;
+    }
+}
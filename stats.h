@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#include "pcm.h"
+
+// Counters for seeing where the time goes when sending. The time taken
+// by send() less the time spent in the output is what went on looking
+// up codes and handing symbols over; tone generation all happens when
+// the Synth is set up. Everything is counted on the sending thread,
+// except what comes from the device ring, which is read from it as it
+// plays.
+struct Stats {
+    enum {SIZES = 24};
+    double started;
+    double setup;       // seconds setting up the Synth
+    long long chars;    // characters and word gaps sent, not bytes
+    double send;        // seconds in send(), output included
+    long long samples;  // samples output, silence included
+    long long silence;  // samples of silence
+    long long calls;    // calls to output()
+    long long sizes[SIZES];  // calls to output() of 2^i to 2^(i+1)-1 samples
+    double output;      // seconds in output() and silence()
+    double wait;        // seconds in flush(), waiting for the output
+    PcmOutputRing *ring;
+
+    Stats();
+    void line(FILE *f);
+    void json(FILE *f);
+};
+
+// Passes everything on to another output, counting it in stats, and
+// prints a stats line to stderr every interval seconds, if that is not
+// zero.
+class PcmOutputStats: public PcmOutput {
+public:
+    PcmOutputStats(PcmOutput *out, Stats *stats, double interval);
+    virtual ~PcmOutputStats();
+    virtual int getSampleRate() { return out->getSampleRate(); }
+    virtual SampleFormat getSampleFormat() { return out->getSampleFormat(); }
+    virtual void output(const void *buf, int n);
+    virtual void silence(int n);
+    virtual void flush();
+    virtual void reset() { out->reset(); }
+    virtual int getDelay() { return out->getDelay(); }
+private:
+    PcmOutput *out;
+    Stats *stats;
+    double interval;
+    double next;
+    void tick(double now);
+};
+
+#endif
@@ -0,0 +1,404 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cw.h"
+#include "synth.h"
+
+#ifdef _WIN32
+#define for if(0);else for
+#endif
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define KERNEL_SSE2 __attribute__((target("sse2")))
+#define KERNEL_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <emmintrin.h>
+#define KERNEL_SSE2
+#endif
+
+#ifndef M_PI
+static double M_PI = 4*atan(1.0);
+#endif
+
+// Kernels that scale a block of unit amplitude samples by a gain and,
+// optionally, an envelope, converting them to 16 bit with saturation.
+// The best one for the CPU we are running on is picked at startup.
+
+void scale_c(short *out, const float *in, const float *env, float gain, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float v = in[i]*gain;
+        if (env != NULL) {
+            v *= env[i];
+        }
+        if (v > 32767) {
+            v = 32767;
+        } else if (v < -32768) {
+            v = -32768;
+        }
+        out[i] = static_cast<short>(v);
+    }
+}
+
+#ifdef KERNEL_SSE2
+KERNEL_SSE2 void scale_sse2(short *out, const float *in, const float *env, float gain, int n)
+{
+    __m128 g = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i+8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in+i), g);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in+i+4), g);
+        if (env != NULL) {
+            a = _mm_mul_ps(a, _mm_loadu_ps(env+i));
+            b = _mm_mul_ps(b, _mm_loadu_ps(env+i+4));
+        }
+        __m128i r = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out+i), r);
+    }
+    scale_c(out+i, in+i, env != NULL ? env+i : NULL, gain, n-i);
+}
+#endif
+
+#ifdef KERNEL_AVX2
+KERNEL_AVX2 void scale_avx2(short *out, const float *in, const float *env, float gain, int n)
+{
+    __m256 g = _mm256_set1_ps(gain);
+    int i = 0;
+    for (; i+16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in+i), g);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in+i+8), g);
+        if (env != NULL) {
+            a = _mm256_mul_ps(a, _mm256_loadu_ps(env+i));
+            b = _mm256_mul_ps(b, _mm256_loadu_ps(env+i+8));
+        }
+        // packs works within 128 bit lanes, so put the quarters back in order
+        __m256i r = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+        r = _mm256_permute4x64_epi64(r, 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out+i), r);
+    }
+    scale_c(out+i, in+i, env != NULL ? env+i : NULL, gain, n-i);
+}
+#endif
+
+void (*scale)(short *out, const float *in, const float *env, float gain, int n) = scale_c;
+
+void scale_u8(unsigned char *out, const float *in, const float *env, float gain, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float v = in[i]*gain;
+        if (env != NULL) {
+            v *= env[i];
+        }
+        if (v > 32767) {
+            v = 32767;
+        } else if (v < -32768) {
+            v = -32768;
+        }
+        out[i] = static_cast<unsigned char>((static_cast<int>(v) >> 8) + 128);
+    }
+}
+
+void scale_f32(float *out, const float *in, const float *env, float gain, int n)
+{
+    gain /= 32768;
+    for (int i = 0; i < n; i++) {
+        out[i] = in[i]*gain;
+        if (env != NULL) {
+            out[i] *= env[i];
+        }
+    }
+}
+
+void init_kernels()
+{
+#if defined(KERNEL_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scale = scale_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scale = scale_sse2;
+    }
+#elif defined(KERNEL_SSE2)
+    int info[4];
+    __cpuid(info, 1);
+    if (info[3] & (1 << 26)) {
+        scale = scale_sse2;
+    }
+#endif
+}
+
+// Sine oscillator built on a rotating phasor: each sample is one complex
+// multiply, so a tone of any length at any frequency can be generated
+// without a table or a call to sin() per sample. The phasor is pulled
+// back onto the unit circle now and then to stop rounding errors from
+// changing the amplitude over long tones.
+class Oscillator {
+public:
+    Oscillator(double freq, int sample_rate);
+    void reset();
+    void generate(float *buf, int n);
+private:
+    enum {RENORM = 256};
+    double c, s;
+    double re, im;
+};
+
+Oscillator::Oscillator(double freq, int sample_rate)
+{
+    c = cos(2*M_PI*freq/sample_rate);
+    s = sin(2*M_PI*freq/sample_rate);
+    reset();
+}
+
+void Oscillator::reset()
+{
+    re = 1;
+    im = 0;
+}
+
+void Oscillator::generate(float *buf, int n)
+{
+    for (int i = 0; i < n; i++) {
+        buf[i] = static_cast<float>(im);
+        double t = re*c - im*s;
+        im = re*s + im*c;
+        re = t;
+        if (i % RENORM == RENORM-1) {
+            double k = 1.5 - 0.5*(re*re + im*im);
+            re *= k;
+            im *= k;
+        }
+    }
+}
+
+static long long gcd(long long a, long long b)
+{
+    while (b != 0) {
+        long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+Synth::Synth(int sample_rate, SampleFormat format, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape)
+ : sample_rate(sample_rate), format(format), amplitude(amplitude)
+{
+    cosine = strcmp(shape, "cosine") == 0;
+    // A word of 31 character units and 19 overall units takes 60/wpm_total
+    // seconds, and 50 character units take 60/wpm_chars. With 95*wpm_chars
+    // *wpm_total ticks to the sample, both kinds of unit are whole ticks.
+    ticks = 95LL*wpm_chars*wpm_total;
+    unit_chars = 114LL*sample_rate*wpm_total;
+    unit_total = static_cast<long long>(sample_rate)*(300LL*wpm_chars - 186LL*wpm_total);
+    long long g = gcd(gcd(ticks, unit_chars), unit_total);
+    ticks /= g;
+    unit_chars /= g;
+    unit_total /= g;
+    spc_chars = static_cast<int>((unit_chars + ticks/2)/ticks);
+    ramp = sample_rate/200;
+    attack = new float[ramp];
+    decay = new float[ramp];
+    envelope(attack, decay, ramp);
+    int longest = static_cast<int>(3*unit_chars/ticks) + 2;
+    float *wave = new float[longest];
+    Oscillator osc(freq, sample_rate);
+    osc.generate(wave, longest);
+    char_gap = 3*unit_total;
+    word_gap = 4*unit_total;
+    nsymbols = TableSize;
+    symbols = new Symbol[nsymbols];
+    for (int i = 0; i < nsymbols; i++) {
+        // every element starts and ends on the sample nearest its exact
+        // time, taking the character to start on a whole sample
+        long long exact = duration(Table[i]);
+        int n = static_cast<int>((exact + ticks/2)/ticks);
+        symbols[i].buf = new char[n*sample_size(format)];
+        symbols[i].n = n;
+        symbols[i].excess = exact - n*ticks;
+        char *p = symbols[i].buf;
+        long long t = 0;
+        long long space = 0;
+        int at = 0;
+        for (const char *c = Table[i]; *c != 0; c++) {
+            if (*c == ' ') {
+                space = char_gap;
+                continue;
+            }
+            t += space;
+            int start = static_cast<int>((t + ticks/2)/ticks);
+            fill_silence(p, format, start-at);
+            p += (start-at)*sample_size(format);
+            t += (*c == '.' ? 1 : 3)*unit_chars;
+            at = static_cast<int>((t + ticks/2)/ticks);
+            p = tone(wave, p, at-start);
+            space = unit_chars;
+        }
+    }
+    delete[] wave;
+}
+
+// Exact length of a code, in ticks, from the start of its first element
+// to the end of its last; codes in a row have a character gap between.
+long long Synth::duration(const char *code)
+{
+    long long t = 0;
+    long long space = 0;
+    for (const char *c = code; *c != 0; c++) {
+        if (*c == ' ') {
+            space = char_gap;
+        } else {
+            t += space + (*c == '.' ? 1 : 3)*unit_chars;
+            space = unit_chars;
+        }
+    }
+    return t;
+}
+
+Synth::~Synth()
+{
+    for (int i = 0; i < nsymbols; i++) {
+        delete[] symbols[i].buf;
+    }
+    delete[] symbols;
+    delete[] attack;
+    delete[] decay;
+}
+
+void Synth::envelope(float *attack, float *decay, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (cosine) {
+            attack[i] = static_cast<float>(0.5 - 0.5*cos(M_PI*i/n));
+        } else {
+            attack[i] = static_cast<float>(i)/n;
+        }
+        decay[n-1-i] = attack[i];
+    }
+}
+
+// Number of samples for a gap of t ticks, as near as it can get to the
+// exact time given what has been output so far.
+int Synth::gap(long long t, long long &carry)
+{
+    long long e = carry + t;
+    long long n = e > 0 ? (e + ticks/2)/ticks : 0;
+    carry = e - n*ticks;
+    return static_cast<int>(n);
+}
+
+char *Synth::shape(char *buf, const float *wave, const float *env, int n)
+{
+    switch (format) {
+    case FORMAT_U8:
+        scale_u8(reinterpret_cast<unsigned char *>(buf), wave, env, amplitude, n);
+        break;
+    case FORMAT_S16:
+        scale(reinterpret_cast<short *>(buf), wave, env, amplitude, n);
+        break;
+    case FORMAT_F32:
+        scale_f32(reinterpret_cast<float *>(buf), wave, env, amplitude, n);
+        break;
+    }
+    return buf + n*sample_size(format);
+}
+
+// Every element starts at phase zero, so each one is a prefix of the
+// same waveform, which is only generated once.
+char *Synth::tone(const float *wave, char *buf, int n)
+{
+    if (2*ramp <= n) {
+        buf = shape(buf, wave, attack, ramp);
+        buf = shape(buf, wave+ramp, NULL, n-2*ramp);
+        return shape(buf, wave+n-ramp, decay, ramp);
+    }
+    // too short for the full ramps, so it is all ramp
+    int r = n/2;
+    float *up = new float[r];
+    float *down = new float[r];
+    envelope(up, down, r);
+    buf = shape(buf, wave, up, r);
+    buf = shape(buf, wave+r, NULL, n-2*r);
+    buf = shape(buf, wave+n-r, down, r);
+    delete[] up;
+    delete[] down;
+    return buf;
+}
+
+int Synth::send(PcmOutput *out, const char *text, int len, long long *carry)
+{
+    long long e = carry != NULL ? *carry : 0;
+    int sent = 0;
+    int symbols[BLOCK];
+    const char *end = text+len;
+    for (const char *p = text; p < end; ) {
+        sent += send(out, symbols, tokenize(p, end, symbols, BLOCK), &e);
+    }
+    if (carry != NULL) {
+        *carry = e;
+    }
+    return sent;
+}
+
+int Synth::send(PcmOutput *out, const int *symbols, int n, long long *carry)
+{
+    long long e = carry != NULL ? *carry : 0;
+    int sent = 0;
+    for (int k = 0; k < n; k++) {
+        int i = symbols[k];
+        if (i == CODE_SPACE) {
+            out->silence(gap(word_gap, e));
+            sent++;
+        } else if (i >= 0 && i < nsymbols) {
+            const Symbol &s = this->symbols[i];
+            out->output(s.buf, s.n);
+            e += s.excess;
+            out->silence(gap(char_gap, e));
+            sent++;
+        }
+    }
+    if (carry != NULL) {
+        *carry = e;
+    }
+    return sent;
+}
+
+// Number of samples that send() produces for the given text.
+long long Synth::length(const char *text, int len, long long *carry)
+{
+    long long e = carry != NULL ? *carry : 0;
+    long long n = 0;
+    int symbols[BLOCK];
+    const char *end = text+len;
+    for (const char *p = text; p < end; ) {
+        n += length(symbols, tokenize(p, end, symbols, BLOCK), &e);
+    }
+    if (carry != NULL) {
+        *carry = e;
+    }
+    return n;
+}
+
+long long Synth::length(const int *symbols, int n, long long *carry)
+{
+    long long e = carry != NULL ? *carry : 0;
+    long long total = 0;
+    for (int k = 0; k < n; k++) {
+        int i = symbols[k];
+        if (i == CODE_SPACE) {
+            total += gap(word_gap, e);
+        } else if (i >= 0 && i < nsymbols) {
+            const Symbol &s = this->symbols[i];
+            total += s.n;
+            e += s.excess;
+            total += gap(char_gap, e);
+        }
+    }
+    if (carry != NULL) {
+        *carry = e;
+    }
+    return total;
+}
@@ -0,0 +1,75 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "pcm.h"
+
+// Picks the fastest sample conversion kernels for this CPU. Call once at
+// startup, along with init_codes(), before making any Synth.
+void init_kernels();
+
+// Each character is rendered once into a ready-made block of samples
+// (its elements and the gaps between them), so that sending text is just
+// a sequence of output() calls on the cached blocks. The gaps after a
+// character or word are passed to the output as runs of silence. A Synth
+// holds the blocks for one set of parameters and is not changed by
+// sending, so any number of threads may send with it at once.
+//
+// Timing follows PARIS: a dot is one unit, a dash three, with one unit
+// between the elements of a character at the character speed, and three
+// units between characters and seven between words at the overall speed.
+// Units are seldom a whole number of samples, so times are kept exactly
+// in ticks, getTicks() to the sample. The difference between the exact
+// time of what has been sent and the samples output for it is the carry,
+// which the caller keeps from one send() to the next so that rounding
+// never adds up: every gap is rounded to bring the output back onto the
+// exact time. Without a carry, each call starts afresh on a whole sample.
+class Synth {
+public:
+    Synth(int sample_rate, SampleFormat format, int wpm_chars, int wpm_total, int freq, int amplitude, const char *shape);
+    ~Synth();
+    int getSampleRate() { return sample_rate; }
+    SampleFormat getSampleFormat() { return format; }
+    int getDotLength() { return spc_chars; }
+    long long getTicks() { return ticks; }
+    // send() returns how many characters and word gaps it sent.
+    int send(PcmOutput *out, const char *text, int len, long long *carry = NULL);
+    long long length(const char *text, int len, long long *carry = NULL);
+    // The same for text already made into symbols by tokenize().
+    int send(PcmOutput *out, const int *symbols, int n, long long *carry = NULL);
+    long long length(const int *symbols, int n, long long *carry = NULL);
+private:
+    // symbols made from text at a time
+    enum {BLOCK = 1024};
+    struct Symbol {
+        char *buf;
+        int n;
+        long long excess;   // exact length less n samples, in ticks
+    };
+    int sample_rate;
+    SampleFormat format;
+    int amplitude;
+    bool cosine;
+    int spc_chars;
+    long long ticks;
+    long long unit_chars;
+    long long unit_total;
+    // one for each entry of Table when the Synth was made
+    Symbol *symbols;
+    int nsymbols;
+    // A space follows the gap after a character, so it makes up the rest
+    // of a word gap.
+    long long char_gap;
+    long long word_gap;
+    // The ramps at either end of an element last 5ms, or half the element
+    // if that is shorter.
+    int ramp;
+    float *attack;
+    float *decay;
+    void envelope(float *attack, float *decay, int n);
+    long long duration(const char *code);
+    int gap(long long t, long long &carry);
+    char *shape(char *buf, const float *wave, const float *env, int n);
+    char *tone(const float *wave, char *buf, int n);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <time.h>
+#endif
+
+#ifdef _WIN32
+
+Mutex::Mutex() { InitializeCriticalSection(&cs); }
+Mutex::~Mutex() { DeleteCriticalSection(&cs); }
+void Mutex::lock() { EnterCriticalSection(&cs); }
+void Mutex::unlock() { LeaveCriticalSection(&cs); }
+
+Condition::Condition() { InitializeConditionVariable(&cond); }
+Condition::~Condition() {}
+void Condition::wait(Mutex &mutex) { SleepConditionVariableCS(&cond, &mutex.cs, INFINITE); }
+void Condition::broadcast() { WakeAllConditionVariable(&cond); }
+
+Thread::Thread(void (*func)(void *), void *arg)
+ : func(func), arg(arg)
+{
+    thread = CreateThread(NULL, 0, start, this, 0, NULL);
+    if (thread == NULL) {
+        fprintf(stderr, "CreateThread failed: %d\n", GetLastError());
+        exit(1);
+    }
+}
+
+Thread::~Thread() { CloseHandle(thread); }
+void Thread::join() { WaitForSingleObject(thread, INFINITE); }
+
+DWORD WINAPI Thread::start(LPVOID p)
+{
+    Thread *This = reinterpret_cast<Thread *>(p);
+    This->func(This->arg);
+    return 0;
+}
+
+double monotonic()
+{
+    static LARGE_INTEGER freq;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return double(t.QuadPart) / freq.QuadPart;
+}
+
+void sleep_seconds(double s)
+{
+    if (s > 0) {
+        Sleep(static_cast<DWORD>(s*1000 + 0.5));
+    }
+}
+
+double wallclock()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    // 100ns intervals since 1601
+    long long t = (static_cast<long long>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    return (t - 116444736000000000LL)*1e-7;
+}
+
+#else
+
+Mutex::Mutex() { pthread_mutex_init(&mutex, NULL); }
+Mutex::~Mutex() { pthread_mutex_destroy(&mutex); }
+void Mutex::lock() { pthread_mutex_lock(&mutex); }
+void Mutex::unlock() { pthread_mutex_unlock(&mutex); }
+
+Condition::Condition() { pthread_cond_init(&cond, NULL); }
+Condition::~Condition() { pthread_cond_destroy(&cond); }
+void Condition::wait(Mutex &mutex) { pthread_cond_wait(&cond, &mutex.mutex); }
+void Condition::broadcast() { pthread_cond_broadcast(&cond); }
+
+Thread::Thread(void (*func)(void *), void *arg)
+ : func(func), arg(arg)
+{
+    int r = pthread_create(&thread, NULL, start, this);
+    if (r != 0) {
+        fprintf(stderr, "pthread_create failed: %d\n", r);
+        exit(1);
+    }
+}
+
+Thread::~Thread() {}
+void Thread::join() { pthread_join(thread, NULL); }
+
+void *Thread::start(void *p)
+{
+    Thread *This = reinterpret_cast<Thread *>(p);
+    This->func(This->arg);
+    return NULL;
+}
+
+double monotonic()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+void sleep_seconds(double s)
+{
+    if (s <= 0) {
+        return;
+    }
+    struct timespec t;
+    t.tv_sec = static_cast<time_t>(s);
+    t.tv_nsec = static_cast<long>((s - t.tv_sec)*1e9);
+    while (nanosleep(&t, &t) != 0 && errno == EINTR) {
+    }
+}
+
+double wallclock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+#endif
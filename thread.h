@@ -0,0 +1,65 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+// Thin wrappers over the threads of the platform.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+class Mutex {
+public:
+    Mutex();
+    ~Mutex();
+    void lock();
+    void unlock();
+private:
+#ifdef _WIN32
+    CRITICAL_SECTION cs;
+#else
+    pthread_mutex_t mutex;
+#endif
+    friend class Condition;
+};
+
+class Condition {
+public:
+    Condition();
+    ~Condition();
+    void wait(Mutex &mutex);
+    void broadcast();
+private:
+#ifdef _WIN32
+    CONDITION_VARIABLE cond;
+#else
+    pthread_cond_t cond;
+#endif
+};
+
+class Thread {
+public:
+    Thread(void (*func)(void *), void *arg);
+    ~Thread();
+    void join();
+private:
+    void (*func)(void *);
+    void *arg;
+#ifdef _WIN32
+    HANDLE thread;
+    static DWORD WINAPI start(LPVOID p);
+#else
+    pthread_t thread;
+    static void *start(void *p);
+#endif
+};
+
+// Seconds on a clock that only ever moves forward, for timing intervals.
+double monotonic();
+void sleep_seconds(double s);
+// Seconds since 1970 on the system clock, which may be set back or
+// forward at any time, so it is only for telling the time of day.
+double wallclock();
+
+#endif
@@ -0,0 +1,1204 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cw.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#define for if(0);else for
+#endif
+
+#ifndef M_PI
+double M_PI = 4*atan(1.0);
+#endif
+
+int WPM_chars = 18;
+int WPM_total = 5;
+int Freq = 750;
+int SampleRate = 22050;
+bool Verbose = false;
+bool Multi = false;
+bool Text = false;
+int Low = 200;
+int High = 3000;
+
+static unsigned get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+    return get16(p) | (static_cast<unsigned long>(get16(p+2)) << 16);
+}
+
+static unsigned long long get64(const unsigned char *p)
+{
+    return get32(p) | (static_cast<unsigned long long>(get32(p+4)) << 32);
+}
+
+// Reads PCM from a WAV or RF64 stream, or failing that takes the stream
+// to be raw 16 bit little endian mono at the rate given. Only the first
+// channel is used, converted to floats in [-1, 1). The stream is never
+// seeked, so a pipe works as well as a file.
+class PcmInput {
+public:
+    PcmInput(FILE *f, int rate);
+    ~PcmInput();
+    int getSampleRate() { return rate; }
+    int read(float *buf, int n);
+private:
+    size_t fill(void *buf, size_t n);
+    bool skip(unsigned long long n);
+    void readHeader();
+    FILE *f;
+    int rate;
+    int channels;
+    int bits;
+    bool floating;
+    int frame;
+    unsigned long long remaining;
+    unsigned char head[12];
+    size_t headlen;
+    unsigned char *raw;
+    enum { FRAMES = 512 };
+};
+
+PcmInput::PcmInput(FILE *f, int rate)
+ : f(f), rate(rate), channels(1), bits(16), floating(false),
+   remaining(~0ULL), headlen(0)
+{
+    headlen = fread(head, 1, sizeof(head), f);
+    if (headlen == sizeof(head)
+     && (memcmp(head, "RIFF", 4) == 0 || memcmp(head, "RF64", 4) == 0)
+     && memcmp(head+8, "WAVE", 4) == 0) {
+        headlen = 0;
+        readHeader();
+    }
+    frame = channels*(bits/8);
+    raw = new unsigned char[FRAMES*frame];
+}
+
+PcmInput::~PcmInput()
+{
+    delete[] raw;
+}
+
+// Reads n bytes, starting with any that were looked at to tell a WAV
+// header from raw samples.
+size_t PcmInput::fill(void *buf, size_t n)
+{
+    size_t got = 0;
+    if (headlen > 0) {
+        got = headlen < n ? headlen : n;
+        memcpy(buf, head, got);
+        memmove(head, head+got, headlen-got);
+        headlen -= got;
+    }
+    return got + fread(static_cast<unsigned char *>(buf)+got, 1, n-got, f);
+}
+
+bool PcmInput::skip(unsigned long long n)
+{
+    unsigned char buf[256];
+    while (n > 0) {
+        size_t r = fill(buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (r == 0) {
+            return false;
+        }
+        n -= r;
+    }
+    return true;
+}
+
+void PcmInput::readHeader()
+{
+    unsigned long long size64 = ~0ULL;
+    bool fmt = false;
+    for (;;) {
+        unsigned char chunk[8];
+        if (fill(chunk, 8) != 8) {
+            fprintf(stderr, "unmorse: no data in WAV file\n");
+            exit(1);
+        }
+        unsigned long size = get32(chunk+4);
+        if (memcmp(chunk, "ds64", 4) == 0 && size >= 16) {
+            unsigned char ds64[16];
+            fill(ds64, 16);
+            size64 = get64(ds64+8);
+            skip(size-16 + (size & 1));
+        } else if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+            unsigned char buf[40];
+            size_t n = size < sizeof(buf) ? size : sizeof(buf);
+            fill(buf, n);
+            skip(size-n + (size & 1));
+            unsigned tag = get16(buf);
+            if (tag == 0xfffe && n >= 26) {
+                tag = get16(buf+24);
+            }
+            channels = get16(buf+2);
+            rate = get32(buf+4);
+            bits = get16(buf+14);
+            floating = tag == 3;
+            if ((tag != 1 && tag != 3) || channels == 0
+             || (floating && bits != 32)
+             || (!floating && bits != 8 && bits != 16 && bits != 24 && bits != 32)) {
+                fprintf(stderr, "unmorse: unsupported WAV format %u, %u bits\n", tag, bits);
+                exit(1);
+            }
+            fmt = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!fmt) {
+                fprintf(stderr, "unmorse: WAV data before format\n");
+                exit(1);
+            }
+            // A header written before the length was known leaves the
+            // size zero or all ones; read to the end of the stream then.
+            if (size == 0xffffffffUL) {
+                remaining = size64;
+            } else if (size != 0) {
+                remaining = size;
+            }
+            return;
+        } else if (!skip(size + (size & 1))) {
+            fprintf(stderr, "unmorse: truncated WAV header\n");
+            exit(1);
+        }
+    }
+}
+
+int PcmInput::read(float *buf, int n)
+{
+    if (n > FRAMES) {
+        n = FRAMES;
+    }
+    if (remaining/frame < static_cast<unsigned long long>(n)) {
+        n = remaining/frame;
+    }
+    int frames = fill(raw, n*frame) / frame;
+    remaining -= frames*frame;
+    const unsigned char *p = raw;
+    for (int i = 0; i < frames; i++, p += frame) {
+        switch (bits) {
+        case 8:
+            buf[i] = (p[0] - 128) / 128.0f;
+            break;
+        case 16:
+            buf[i] = static_cast<short>(get16(p)) / 32768.0f;
+            break;
+        case 24:
+            buf[i] = static_cast<int>((get16(p) | static_cast<unsigned long>(p[2]) << 16) << 8) / 2147483648.0f;
+            break;
+        case 32:
+            if (floating) {
+                union { unsigned int u; float f; } v;
+                v.u = get32(p);
+                buf[i] = v.f;
+            } else {
+                buf[i] = static_cast<int>(get32(p)) / 2147483648.0f;
+            }
+            break;
+        }
+    }
+    return frames;
+}
+
+// Narrowband tone detector. Each block of samples yields the amplitude
+// of the signal at the frequency of interest.
+class Goertzel {
+public:
+    Goertzel(double freq, int rate, int n);
+    int run(const float *x, int len, double &mag);
+private:
+    double coeff;
+    int n;
+    int count;
+    double s1, s2;
+};
+
+Goertzel::Goertzel(double freq, int rate, int n)
+ : coeff(2*cos(2*M_PI*freq/rate)), n(n), count(0), s1(0), s2(0)
+{
+}
+
+// Takes samples until the current block is complete, returning how many
+// were used. mag is set to the amplitude if a block was completed and
+// to -1 otherwise.
+int Goertzel::run(const float *x, int len, double &mag)
+{
+    int k = n - count < len ? n - count : len;
+    double a = s1, b = s2;
+    for (int i = 0; i < k; i++) {
+        double s = x[i] + coeff*a - b;
+        b = a;
+        a = s;
+    }
+    count += k;
+    mag = -1;
+    if (count == n) {
+        double power = a*a + b*b - coeff*a*b;
+        mag = power > 0 ? 2*sqrt(power)/n : 0;
+        a = b = 0;
+        count = 0;
+    }
+    s1 = a;
+    s2 = b;
+    return k;
+}
+
+// Turns detector blocks into text. The key is down while the amplitude
+// is above halfway between the tracked tone and noise levels. Marks
+// are split into dots and dashes around the midpoint of their running
+// averages, gaps into element, character and word gaps around multiples
+// of the dot and of the typical character gap, so that both the speed
+// and any Farnsworth spacing are followed as they change. The first few
+// marks are held back until they show what a dot and a dash are.
+class Decoder {
+public:
+    Decoder(double blocks_per_second, int wpm_chars, int wpm_total);
+    virtual ~Decoder() {}
+    void block(double mag);
+    virtual void finish();
+    bool idle(double seconds) { return !key && run > seconds*rate; }
+    double wpm();
+    int unknown() { return bad; }
+protected:
+    virtual void emit(char c);
+private:
+    void learn(int len);
+    void seed();
+    void mark(int len);
+    void gap(int len);
+    void silence(int len);
+    void endChar();
+    double split();
+    double charGap();
+    enum { SEED = 6 };
+    int seeds[2*SEED];
+    int nseeds;
+    double signal, noise;
+    bool key;
+    int run;
+    int pending;
+    double dot, dash;
+    double spacing;
+    int last;
+    double prior;
+    enum { HISTORY = 16 };
+    int gaps[HISTORY];
+    int ngaps;
+    int node;
+    bool space;
+    bool line;
+    int bad;
+    double rate;
+};
+
+// Signals weaker than this, relative to full scale, are never keyed.
+static const double Squelch = 0.001;
+
+Decoder::Decoder(double blocks_per_second, int wpm_chars, int wpm_total)
+ : nseeds(0), signal(0), noise(0), key(false), run(0), pending(0), last(0), ngaps(0), node(1),
+   space(false), line(false), bad(0), rate(blocks_per_second)
+{
+    // Start from the timing morse itself would use at these speeds,
+    // until seed() has the real one.
+    double chars = 60*rate/(wpm_chars*50);
+    double total = (60*rate/wpm_total - chars*31) / 19;
+    dot = chars;
+    dash = 3*chars;
+    spacing = chars;
+    prior = chars + 3*total;
+}
+
+void Decoder::block(double mag)
+{
+    double threshold = noise + (signal - noise)/2;
+    if (threshold < 3*noise) {
+        threshold = 3*noise;
+    }
+    if (threshold < Squelch) {
+        threshold = Squelch;
+    }
+    bool down = mag > threshold;
+    // Follow the tone level while the key is down and the noise level
+    // while it is up, slowly forgetting a tone that has gone away. Blocks
+    // on the wrong side of the threshold are edges or glitches and would
+    // only pull the two levels together.
+    if (key && down) {
+        signal += (mag - signal)/4;
+    } else if (!key && !down) {
+        noise += (mag - noise)/16;
+        signal += (noise - signal)/(10*rate);
+    }
+    // A change only counts once it has lasted two blocks, which keeps
+    // single blocks of noise from splitting marks or adding dots.
+    run++;
+    if (down != key) {
+        pending++;
+    } else {
+        pending = 0;
+    }
+    if (pending == 2) {
+        if (nseeds >= 0) {
+            learn(run-2);
+        } else if (key) {
+            mark(run-2);
+        } else {
+            gap(run-2);
+        }
+        key = down;
+        run = 2;
+        pending = 0;
+    } else if (!key) {
+        // blocks that may be the start of a mark are not yet silence
+        silence(run - pending);
+    }
+}
+
+void Decoder::finish()
+{
+    if (key) {
+        if (nseeds >= 0) {
+            learn(run);
+        } else {
+            mark(run);
+        }
+    }
+    if (nseeds >= 0) {
+        seed();
+    }
+    endChar();
+    if (line) {
+        emit('\n');
+    }
+}
+
+// Keeps the first SEED marks and the gaps between them, leaving out the
+// silence before the first.
+void Decoder::learn(int len)
+{
+    if (!key && nseeds == 0) {
+        return;
+    }
+    seeds[nseeds++] = len;
+    if (nseeds == 2*SEED-1) {
+        seed();
+    }
+}
+
+// Sets the dot and dash from the marks held back, split into two groups
+// where one is longest compared with the next shorter, then decodes them.
+// Marks all of one length are taken as dots or as dashes by which the
+// starting speed puts them nearer to.
+void Decoder::seed()
+{
+    int n = nseeds;
+    nseeds = -1;
+    int marks[SEED];
+    int m = 0;
+    for (int i = 0; i < n; i += 2) {
+        int j = m++;
+        while (j > 0 && marks[j-1] > seeds[i]) {
+            marks[j] = marks[j-1];
+            j--;
+        }
+        marks[j] = seeds[i];
+    }
+    if (m == 0) {
+        return;
+    }
+    int split = 0;
+    double ratio = 0;
+    for (int i = 1; i < m; i++) {
+        double r = (marks[i] + 1.0)/(marks[i-1] + 1.0);
+        if (r > ratio) {
+            ratio = r;
+            split = i;
+        }
+    }
+    double nominal = dot;
+    if (ratio >= 2) {
+        double sum = 0;
+        for (int i = 0; i < split; i++) {
+            sum += marks[i];
+        }
+        dot = sum/split;
+        sum = 0;
+        for (int i = split; i < m; i++) {
+            sum += marks[i];
+        }
+        dash = sum/(m-split);
+    } else {
+        double sum = 0;
+        for (int i = 0; i < m; i++) {
+            sum += marks[i];
+        }
+        double mean = sum/m;
+        if (mean*mean < dot*dash) {
+            dot = mean;
+            dash = 3*mean;
+        } else {
+            dot = mean/3;
+            dash = mean;
+        }
+    }
+    if (dot < 1) {
+        dot = 1;
+    }
+    // gaps shorter than a dash are inside characters
+    double sum = 0;
+    int count = 0;
+    for (int i = 1; i < n; i += 2) {
+        if (seeds[i] < dash) {
+            sum += seeds[i];
+            count++;
+        }
+    }
+    spacing = count > 0 ? sum/count : dot;
+    prior *= dot/nominal;
+    for (int i = 0; i < n; i++) {
+        if (i % 2 == 0) {
+            mark(seeds[i]);
+        } else {
+            silence(seeds[i]);
+            gap(seeds[i]);
+        }
+    }
+}
+
+void Decoder::mark(int len)
+{
+    // A change of at least two to one between consecutive marks means
+    // one was a dot and the other a dash. If the averages do not already
+    // say so, start again from them to follow a large change of speed at
+    // once; if they do, keep averaging, as at high speeds a mark is only
+    // a few blocks long and often one block out.
+    if (last > 0) {
+        double mid = (dot + dash)/2;
+        double was = dot;
+        if (len > 2*last && !(last < mid && len >= mid)) {
+            dot = last;
+            dash = len;
+        } else if (last > 2*len && !(len < mid && last >= mid)) {
+            dot = len;
+            dash = last;
+        }
+        spacing *= dot/was;
+    }
+    last = len;
+    bool long_mark = len >= (dot + dash)/2;
+    if (long_mark) {
+        dash += (len - dash)/4;
+    } else {
+        dot += (len - dot)/4;
+    }
+    node = tree_next(node, long_mark);
+}
+
+// Ends the character, and then the word, once the key has been up for
+// len blocks.
+void Decoder::silence(int len)
+{
+    if (node != 1 && len > split()) {
+        endChar();
+    }
+    if (space && len > 1.6*charGap()) {
+        emit(' ');
+        space = false;
+    }
+}
+
+void Decoder::gap(int len)
+{
+    if (len <= split()) {
+        spacing += (len - spacing)/4;
+        return;
+    }
+    if (ngaps < HISTORY) {
+        gaps[ngaps++] = len;
+    } else {
+        memmove(gaps, gaps+1, (HISTORY-1)*sizeof(gaps[0]));
+        gaps[HISTORY-1] = len;
+    }
+}
+
+// The detector shortens marks and lengthens gaps by about the same, so a
+// gap between characters is the one inside them plus a dot and a gap;
+// halfway to it splits the two. Without any such error it is two dots.
+double Decoder::split()
+{
+    return (dot + 3*spacing)/2;
+}
+
+// Most gaps between characters are not word gaps, so the lower quartile
+// of the recent ones is a character gap.
+double Decoder::charGap()
+{
+    if (ngaps == 0) {
+        return prior;
+    }
+    int sorted[HISTORY];
+    for (int i = 0; i < ngaps; i++) {
+        int j = i;
+        while (j > 0 && sorted[j-1] > gaps[i]) {
+            sorted[j] = sorted[j-1];
+            j--;
+        }
+        sorted[j] = gaps[i];
+    }
+    return sorted[ngaps/4];
+}
+
+// Writes out what was sent as the code of a node of the decoding tree, a
+// character or a prosign in angle brackets, and returns its length, which
+// is 0 for a code with no meaning.
+static int node_text(int node, char *out)
+{
+    if (Tree[node] != 0) {
+        out[0] = Tree[node];
+        return 1;
+    }
+    const char *name = TreeProsign[node];
+    if (name == NULL) {
+        return 0;
+    }
+    int n = 0;
+    out[n++] = '<';
+    while (*name != 0) {
+        out[n++] = *name++;
+    }
+    out[n++] = '>';
+    return n;
+}
+
+void Decoder::endChar()
+{
+    if (node == 1) {
+        return;
+    }
+    char text[MAX_PROSIGN+2];
+    int n = node_text(node, text);
+    if (n > 0) {
+        for (int i = 0; i < n; i++) {
+            emit(text[i]);
+        }
+        space = true;
+    } else {
+        bad++;
+    }
+    node = 1;
+}
+
+void Decoder::emit(char c)
+{
+    putchar(c);
+    fflush(stdout);
+    line = c != '\n';
+}
+
+// The detector threshold shortens marks and lengthens gaps alike, so a
+// dot and the gap after it together still make two units.
+double Decoder::wpm()
+{
+    return 60*rate/((dot + spacing)/2*50);
+}
+
+// Radix 2 FFT of a fixed power of two size, in place.
+class FFT {
+public:
+    FFT(int n);
+    ~FFT();
+    void run(float *re, float *im);
+private:
+    int n;
+    int *rev;
+    float *cosine;
+    float *sine;
+};
+
+FFT::FFT(int n)
+ : n(n)
+{
+    int bits = 0;
+    while ((1 << bits) < n) {
+        bits++;
+    }
+    rev = new int[n];
+    for (int i = 0; i < n; i++) {
+        rev[i] = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b)) {
+                rev[i] |= 1 << (bits-1-b);
+            }
+        }
+    }
+    cosine = new float[n/2];
+    sine = new float[n/2];
+    for (int i = 0; i < n/2; i++) {
+        cosine[i] = cos(2*M_PI*i/n);
+        sine[i] = -sin(2*M_PI*i/n);
+    }
+}
+
+FFT::~FFT()
+{
+    delete[] rev;
+    delete[] cosine;
+    delete[] sine;
+}
+
+void FFT::run(float *re, float *im)
+{
+    for (int i = 0; i < n; i++) {
+        int j = rev[i];
+        if (j > i) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (int size = 2; size <= n; size *= 2) {
+        int half = size/2;
+        int step = n/size;
+        for (int i = 0; i < n; i += size) {
+            for (int j = 0; j < half; j++) {
+                float wr = cosine[j*step], wi = sine[j*step];
+                float *ar = &re[i+j], *ai = &im[i+j];
+                float *br = &re[i+j+half], *bi = &im[i+j+half];
+                float tr = *br*wr - *bi*wi;
+                float ti = *br*wi + *bi*wr;
+                *br = *ar - tr;
+                *bi = *ai - ti;
+                *ar += tr;
+                *ai += ti;
+            }
+        }
+    }
+}
+
+// One signal found by the filter bank. Its decoder prints a line for
+// each word, tagged with the frequency of the tone.
+class Channel : public Decoder {
+public:
+    Channel(double freq, double blocks_per_second, int wpm_chars, int wpm_total);
+    double freq;
+    void finish();
+protected:
+    void emit(char c);
+private:
+    enum { MAXWORD = 63 };
+    char word[MAXWORD+1];
+    int len;
+};
+
+Channel::Channel(double freq, double blocks_per_second, int wpm_chars, int wpm_total)
+ : Decoder(blocks_per_second, wpm_chars, wpm_total), freq(freq), len(0)
+{
+}
+
+// The last word has no space after it to print it.
+void Channel::finish()
+{
+    Decoder::finish();
+    emit('\n');
+}
+
+void Channel::emit(char c)
+{
+    if (c != ' ' && c != '\n') {
+        word[len++] = c;
+        if (len < MAXWORD) {
+            return;
+        }
+    }
+    if (len > 0) {
+        word[len] = 0;
+        printf("%5.0f Hz: %s\n", freq, word);
+        fflush(stdout);
+        len = 0;
+    }
+}
+
+// Decodes every tone between two frequencies in one pass. An FFT over a
+// sliding Hann window gives the power in each bin every quarter window.
+// A bin whose average power peaks locally and stands well clear of the
+// noise floor gets a Channel, fed from the bin and its neighbours so that
+// a tone falling between two bins is not split; after a long silence
+// the channel is dropped again. The cost per sample is the same however
+// many signals there are.
+class FilterBank {
+public:
+    FilterBank(int rate, int low, int high);
+    ~FilterBank();
+    void run(const float *x, int len);
+    void finish();
+    int count() { return found; }
+    static int size(int rate);
+    static void bins(int rate, int low, int high, int *lo, int *hi);
+private:
+    void frame();
+    void scan();
+    double level(const float *power, int k);
+    int rate;
+    int n;
+    int hop;
+    int lo, hi;
+    FFT *fft;
+    float *window;
+    float *in;
+    int fill;
+    float *re, *im;
+    double *avg;
+    float *history;
+    int frames_kept;
+    Channel **channels;
+    int frames;
+    int found;
+};
+
+// A window of about 20 ms resolves tones some 50 Hz apart, and a quarter
+// of it still times elements at 40 WPM.
+int FilterBank::size(int rate)
+{
+    int n = 16;
+    while (n < rate/50) {
+        n *= 2;
+    }
+    return n;
+}
+
+// The bins searched for tones from low to high Hz, leaving out the two at
+// either end, which have no neighbours to peak against. hi is below lo if
+// there are none.
+void FilterBank::bins(int rate, int low, int high, int *lo, int *hi)
+{
+    int n = size(rate);
+    *lo = static_cast<int>(static_cast<double>(low)*n/rate);
+    *hi = static_cast<int>(static_cast<double>(high)*n/rate);
+    if (*lo < 2) {
+        *lo = 2;
+    }
+    if (*hi > n/2-2) {
+        *hi = n/2-2;
+    }
+}
+
+FilterBank::FilterBank(int rate, int low, int high)
+ : rate(rate), n(size(rate)), fill(0), frames(0), found(0)
+{
+    hop = n/4;
+    // The power in every bin over the last two seconds or so, so that a
+    // new channel can decode the signal that made it stand out.
+    frames_kept = 1;
+    while (frames_kept*hop < 2*rate) {
+        frames_kept *= 2;
+    }
+    bins(rate, low, high, &lo, &hi);
+    fft = new FFT(n);
+    window = new float[n];
+    for (int i = 0; i < n; i++) {
+        window[i] = 0.5 - 0.5*cos(2*M_PI*i/n);
+    }
+    in = new float[n];
+    re = new float[n];
+    im = new float[n];
+    avg = new double[n/2];
+    history = new float[frames_kept*(n/2)];
+    channels = new Channel *[n/2];
+    for (int k = 0; k < n/2; k++) {
+        avg[k] = 0;
+        channels[k] = NULL;
+    }
+}
+
+FilterBank::~FilterBank()
+{
+    for (int k = 0; k < n/2; k++) {
+        delete channels[k];
+    }
+    delete fft;
+    delete[] window;
+    delete[] in;
+    delete[] re;
+    delete[] im;
+    delete[] avg;
+    delete[] history;
+    delete[] channels;
+}
+
+void FilterBank::run(const float *x, int len)
+{
+    while (len > 0) {
+        int k = n - fill < len ? n - fill : len;
+        memcpy(in+fill, x, k*sizeof(float));
+        fill += k;
+        x += k;
+        len -= k;
+        if (fill == n) {
+            frame();
+            memmove(in, in+hop, (n-hop)*sizeof(float));
+            fill = n - hop;
+        }
+    }
+}
+
+// Amplitude of the tone around bin k, scaled so that a tone of amplitude
+// 1 reads 1 wherever it falls between bins.
+double FilterBank::level(const float *power, int k)
+{
+    return sqrt((power[k-1] + power[k] + power[k+1])/1.5)*4/n;
+}
+
+void FilterBank::frame()
+{
+    for (int i = 0; i < n; i++) {
+        re[i] = in[i]*window[i];
+        im[i] = 0;
+    }
+    fft->run(re, im);
+    const double alpha = static_cast<double>(hop)/rate;
+    float *power = &history[(frames % frames_kept)*(n/2)];
+    for (int k = lo-1; k <= hi+1; k++) {
+        power[k] = re[k]*re[k] + im[k]*im[k];
+        avg[k] += (power[k] - avg[k])*alpha;
+    }
+    frames++;
+    if (frames % 16 == 0) {
+        scan();
+    }
+    for (int k = lo; k <= hi; k++) {
+        if (channels[k] == NULL) {
+            continue;
+        }
+        channels[k]->block(level(power, k));
+        if (channels[k]->idle(30)) {
+            channels[k]->finish();
+            delete channels[k];
+            channels[k] = NULL;
+        }
+    }
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *static_cast<const double *>(a), y = *static_cast<const double *>(b);
+    return x < y ? -1 : x > y;
+}
+
+// Looks for new signals and moves channels whose tone has drifted into
+// the next bin.
+void FilterBank::scan()
+{
+    int bins = hi - lo + 1;
+    double *sorted = new double[bins];
+    memcpy(sorted, avg+lo, bins*sizeof(double));
+    qsort(sorted, bins, sizeof(double), compare);
+    // Besides standing 6 dB above the median, a signal must be no more
+    // than 30 dB below the strongest, or the sidelobes of a clean tone in
+    // silence would be taken for signals too.
+    double floor = 4*sorted[bins/2];
+    if (floor < sorted[bins-1]/1000) {
+        floor = sorted[bins-1]/1000;
+    }
+    delete[] sorted;
+    double squelch = Squelch*n/4;
+    squelch *= squelch;
+    for (int k = lo; k <= hi; k++) {
+        if (channels[k] != NULL) {
+            int to = avg[k+1] > 2*avg[k] ? k+1 : avg[k-1] > 2*avg[k] ? k-1 : k;
+            if (to != k && to >= lo && to <= hi && channels[to] == NULL) {
+                channels[to] = channels[k];
+                channels[k] = NULL;
+                channels[to]->freq = static_cast<double>(to)*rate/n;
+            }
+            continue;
+        }
+        if (avg[k] <= floor || avg[k] <= squelch) {
+            continue;
+        }
+        bool peak = true;
+        for (int j = k-2; j <= k+2 && peak; j++) {
+            if (j < lo-1 || j > hi+1 || j == k) {
+                continue;
+            }
+            if (avg[j] > avg[k] || (j >= lo && j <= hi && channels[j] != NULL)) {
+                peak = false;
+            }
+        }
+        if (!peak) {
+            continue;
+        }
+        // Place the tone between the bins by fitting a parabola to the
+        // log power around the peak.
+        double a = log(avg[k-1] + 1e-30), b = log(avg[k]), c = log(avg[k+1] + 1e-30);
+        double d = a - 2*b + c < 0 ? 0.5*(a - c)/(a - 2*b + c) : 0;
+        channels[k] = new Channel((k + d)*rate/n, static_cast<double>(rate)/hop, WPM_chars, WPM_total);
+        found++;
+        int kept = frames < frames_kept ? frames : frames_kept;
+        for (int i = frames - kept; i < frames - 1; i++) {
+            channels[k]->block(level(&history[(i % frames_kept)*(n/2)], k));
+        }
+        if (Verbose) {
+            fprintf(stderr, "signal at %.0f Hz\n", channels[k]->freq);
+        }
+    }
+}
+
+void FilterBank::finish()
+{
+    for (int k = lo; k <= hi; k++) {
+        if (channels[k] != NULL) {
+            channels[k]->finish();
+        }
+    }
+}
+
+// Decodes text written as dots and dashes, as unmorse.py does: codes
+// are separated by spaces, commas or angle brackets, a / stands for a
+// space and each line of input gives a line of output. Prosigns come out
+// as their names in angle brackets. Empty lines and codes with no
+// character are dropped. The input is walked byte by byte
+// through the decoding tree, so nothing is looked up by string.
+void decode_text(FILE *f)
+{
+    enum { OTHER, DOT, DASH, SEP, SLASH, EOL };
+    static unsigned char cls[256];
+    cls['.'] = DOT;
+    cls['-'] = DASH;
+    cls[' '] = cls['\t'] = cls['\r'] = cls[','] = cls['<'] = cls['>'] = SEP;
+    cls['/'] = SLASH;
+    cls['\n'] = EOL;
+    // Past the tree nodes, a state for a lone slash.
+    const int space = 256;
+    enum { SIZE = 65536 };
+    static unsigned char in[SIZE];
+    // A byte of input can end a character, or a prosign, and a line both.
+    static char out[SIZE+MAX_PROSIGN+3];
+    int o = 0;
+    int line = 0;
+    int node = 1;
+    int bad = 0;
+    size_t n;
+    while ((n = fread(in, 1, sizeof(in), f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            switch (cls[in[i]]) {
+            case DOT:
+                node = node < space ? tree_next(node, false) : 0;
+                break;
+            case DASH:
+                node = node < space ? tree_next(node, true) : 0;
+                break;
+            case SLASH:
+                node = node == 1 ? space : 0;
+                break;
+            case OTHER:
+                node = 0;
+                break;
+            case SEP:
+            case EOL:
+                if (node == space) {
+                    out[o++] = ' ';
+                } else if (node != 1) {
+                    int len = node_text(node, out+o);
+                    if (len == 0) {
+                        bad++;
+                    }
+                    o += len;
+                }
+                node = 1;
+                if (cls[in[i]] == EOL) {
+                    if (o > line) {
+                        out[o++] = '\n';
+                    } else {
+                        o = line;
+                    }
+                    line = o;
+                }
+                break;
+            }
+            if (o >= SIZE) {
+                fwrite(out, 1, line, stdout);
+                memmove(out, out+line, o-line);
+                o -= line;
+                line = 0;
+                if (o >= SIZE) {
+                    fwrite(out, 1, o, stdout);
+                    o = line = 0;
+                }
+            }
+        }
+    }
+    if (node == space) {
+        out[o++] = ' ';
+    } else if (node != 1) {
+        int len = node_text(node, out+o);
+        if (len == 0) {
+            bad++;
+        }
+        o += len;
+    }
+    if (o > line) {
+        out[o++] = '\n';
+    }
+    fwrite(out, 1, o, stdout);
+    if (Verbose) {
+        fprintf(stderr, "%d unknown codes\n", bad);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int a = 1;
+    while (a < argc && argv[a][0] == '-' && argv[a][1] != 0) {
+        switch (argv[a][1]) {
+        case 'c':
+            if (argv[a][2]) {
+                WPM_chars = atoi(argv[a]+2);
+            } else {
+                a++;
+                WPM_chars = atoi(argv[a]);
+            }
+            break;
+        case 'f':
+            if (argv[a][2]) {
+                Freq = atoi(argv[a]+2);
+            } else {
+                a++;
+                Freq = atoi(argv[a]);
+            }
+            break;
+        case 'm':
+            {
+                const char *range;
+                if (argv[a][2]) {
+                    range = &argv[a][2];
+                } else {
+                    a++;
+                    range = argv[a];
+                }
+                if (sscanf(range, "%d-%d", &Low, &High) != 2 || Low < 0 || High <= Low) {
+                    fprintf(stderr, "%s: invalid frequency range %s\n", argv[0], range);
+                    exit(1);
+                }
+                Multi = true;
+            }
+            break;
+        case 'r':
+            if (argv[a][2]) {
+                SampleRate = atoi(argv[a]+2);
+            } else {
+                a++;
+                SampleRate = atoi(argv[a]);
+            }
+            break;
+        case 't':
+            Text = true;
+            break;
+        case 'v':
+            Verbose = true;
+            break;
+        case 'w':
+            if (argv[a][2]) {
+                WPM_total = atoi(argv[a]+2);
+            } else {
+                a++;
+                WPM_total = atoi(argv[a]);
+            }
+            break;
+        default:
+            fprintf(stderr, "%s: invalid option %s\n", argv[0], argv[a]);
+            exit(1);
+        }
+        a++;
+    }
+    if (WPM_total > WPM_chars) {
+        WPM_chars = WPM_total;
+    }
+    if (WPM_chars == 0 || WPM_total == 0) {
+        fprintf(stderr, "%s: Invalid wpm parameter\n", argv[0]);
+        exit(1);
+    }
+    FILE *f = stdin;
+    if (a < argc && strcmp(argv[a], "-") != 0) {
+        f = fopen(argv[a], "rb");
+        if (f == NULL) {
+            perror(argv[a]);
+            exit(1);
+        }
+    }
+#ifdef _WIN32
+    else {
+        _setmode(_fileno(stdin), _O_BINARY);
+    }
+#endif
+    init_codes();
+    if (Text) {
+        decode_text(f);
+        if (f != stdin) {
+            fclose(f);
+        }
+        return 0;
+    }
+    PcmInput in(f, SampleRate);
+    int rate = in.getSampleRate();
+    float buf[512];
+    int len;
+    if (Multi) {
+        int lo = 0, hi = -1;
+        if (rate > 0) {
+            FilterBank::bins(rate, Low, High, &lo, &hi);
+        }
+        if (hi < lo || 2*Low >= rate) {
+            fprintf(stderr, "%s: range %d-%d Hz not possible at %d Hz\n", argv[0], Low, High, rate);
+            exit(1);
+        }
+        FilterBank bank(rate, Low, High);
+        while ((len = in.read(buf, 512)) > 0) {
+            bank.run(buf, len);
+        }
+        bank.finish();
+        if (Verbose) {
+            fprintf(stderr, "%d signals\n", bank.count());
+        }
+        if (f != stdin) {
+            fclose(f);
+        }
+        return 0;
+    }
+    if (rate <= 0 || Freq <= 0 || 2*Freq >= rate) {
+        fprintf(stderr, "%s: tone of %d Hz not possible at %d Hz\n", argv[0], Freq, rate);
+        exit(1);
+    }
+    // Blocks of 5 ms keep the detector bandwidth near 200 Hz and still
+    // give a dot some five blocks at 50 WPM; the decoder copes with down
+    // to about three, which is some 70 WPM.
+    int n = rate/200;
+    if (n < 16) {
+        n = 16;
+    }
+    Goertzel detector(Freq, rate, n);
+    Decoder decoder(static_cast<double>(rate)/n, WPM_chars, WPM_total);
+    while ((len = in.read(buf, 512)) > 0) {
+        const float *p = buf;
+        while (len > 0) {
+            double mag;
+            int k = detector.run(p, len, mag);
+            p += k;
+            len -= k;
+            if (mag >= 0) {
+                decoder.block(mag);
+            }
+        }
+    }
+    decoder.finish();
+    if (Verbose) {
+        fprintf(stderr, "%.1f WPM chars, %d unknown characters\n", decoder.wpm(), decoder.unknown());
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    return 0;
+}
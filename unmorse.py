@@ -46,7 +46,7 @@ Unmorse = {
     "---...":':', 
     "-....-":'-', 
     ".----.":'\'',
-    "-.--.-":'(', 
+    "-.--.": '(', 
     "-.--.-":')', 
     "..--.-":'_', 
     ".--.-": '', 